@@ -0,0 +1,172 @@
+/* conn_table.c
+ * Per-connection contexts indexed by connection handle.
+ *
+ * The contexts live in a fixed array; a small open-addressed hash maps a
+ * connection handle to its entry, so the lookups done on every write and
+ * every notification do not scan the array. The hash has at least twice as
+ * many buckets as entries and uses linear probing; removal shifts the rest
+ * of the probe run back instead of leaving tombstones, so a lookup never
+ * walks further than the run it belongs to.
+ */
+#include <string.h>
+
+#include "host/ble_hs.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "conn_table.h"
+
+static const char *TAG = "conn_table";
+
+#if CONFIG_FAN_MAX_CONNECTIONS > CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#error "FAN_MAX_CONNECTIONS exceeds BT_NIMBLE_MAX_CONNECTIONS"
+#endif
+
+/* Smallest power of two that is at least 2 * CONN_TABLE_MAX */
+#if CONN_TABLE_MAX <= 4
+#define HASH_SIZE   8
+#elif CONN_TABLE_MAX <= 8
+#define HASH_SIZE   16
+#elif CONN_TABLE_MAX <= 16
+#define HASH_SIZE   32
+#elif CONN_TABLE_MAX <= 32
+#define HASH_SIZE   64
+#elif CONN_TABLE_MAX <= 64
+#define HASH_SIZE   128
+#else
+#define HASH_SIZE   256
+#endif
+#define HASH_MASK   (HASH_SIZE - 1)
+
+_Static_assert(HASH_SIZE >= 2 * CONN_TABLE_MAX, "conn_table hash too small");
+
+static conn_ctx_t s_ctx[CONN_TABLE_MAX];
+static uint8_t s_hash[HASH_SIZE];       /* entry index + 1, 0 = empty bucket */
+static int s_count;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* NimBLE hands out small consecutive handles, so the low bits spread well */
+static inline int home_of(uint16_t conn_handle)
+{
+    return conn_handle & HASH_MASK;
+}
+
+/* Under s_mux: bucket holding `conn_handle`, or -1 */
+static int bucket_of(uint16_t conn_handle)
+{
+    for (int b = home_of(conn_handle); s_hash[b] != 0; b = (b + 1) & HASH_MASK) {
+        if (s_ctx[s_hash[b] - 1].conn_handle == conn_handle) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+/* Under s_mux: empty bucket `hole` and close the gap it leaves in its run */
+static void bucket_clear(int hole)
+{
+    s_hash[hole] = 0;
+    for (int b = (hole + 1) & HASH_MASK; s_hash[b] != 0; b = (b + 1) & HASH_MASK) {
+        int home = home_of(s_ctx[s_hash[b] - 1].conn_handle);
+        /* can the entry at b move back into the hole, i.e. is its home
+         * outside the (cyclic) range (hole, b]? */
+        bool movable = hole <= b ? (home <= hole || home > b)
+                                 : (home <= hole && home > b);
+        if (movable) {
+            s_hash[hole] = s_hash[b];
+            s_hash[b] = 0;
+            hole = b;
+        }
+    }
+}
+
+conn_ctx_t *conn_table_add(uint16_t conn_handle)
+{
+    conn_ctx_t *c = NULL;
+
+    portENTER_CRITICAL(&s_mux);
+    if (bucket_of(conn_handle) >= 0) {
+        portEXIT_CRITICAL(&s_mux);
+        return conn_table_get(conn_handle);     /* already there */
+    }
+    for (int i = 0; i < CONN_TABLE_MAX; i++) {
+        if (!s_ctx[i].in_use) {
+            c = &s_ctx[i];
+            memset(c, 0, sizeof(*c));
+            c->in_use = true;
+            c->conn_handle = conn_handle;
+            c->mtu = BLE_ATT_MTU_DFLT;
+            c->tx_phy = BLE_HCI_LE_PHY_1M;
+            c->rx_phy = BLE_HCI_LE_PHY_1M;
+            c->tx_octets = CONN_LL_OCTETS_DFLT;
+            c->rx_octets = CONN_LL_OCTETS_DFLT;
+            c->last_activity_us = esp_timer_get_time();
+
+            int b = home_of(conn_handle);
+            while (s_hash[b] != 0) {
+                b = (b + 1) & HASH_MASK;
+            }
+            s_hash[b] = (uint8_t)(i + 1);
+            s_count++;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_mux);
+
+    if (c == NULL) {
+        ESP_LOGW(TAG, "no room for conn_handle=%d", conn_handle);
+    }
+    return c;
+}
+
+void conn_table_remove(uint16_t conn_handle)
+{
+    portENTER_CRITICAL(&s_mux);
+    int b = bucket_of(conn_handle);
+    if (b >= 0) {
+        conn_ctx_t *c = &s_ctx[s_hash[b] - 1];
+        bucket_clear(b);
+        c->in_use = false;
+        c->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        s_count--;
+    }
+    portEXIT_CRITICAL(&s_mux);
+}
+
+conn_ctx_t *conn_table_get(uint16_t conn_handle)
+{
+    conn_ctx_t *c = NULL;
+
+    portENTER_CRITICAL(&s_mux);
+    int b = bucket_of(conn_handle);
+    if (b >= 0) {
+        c = &s_ctx[s_hash[b] - 1];
+    }
+    portEXIT_CRITICAL(&s_mux);
+    return c;
+}
+
+conn_ctx_t *conn_table_at(int i)
+{
+    return s_ctx[i].in_use ? &s_ctx[i] : NULL;
+}
+
+int conn_table_count(void)
+{
+    return s_count;
+}
+
+bool conn_table_has_room(void)
+{
+    return s_count < CONN_TABLE_MAX;
+}
+
+void conn_table_touch(uint16_t conn_handle)
+{
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    if (c) {
+        c->last_activity_us = esp_timer_get_time();
+        c->stats.rx_writes++;
+    }
+}
@@ -0,0 +1,692 @@
+/* fan_adv.c
+ * Advertising scheduler.
+ *
+ * The fast phase is a deadline, not a mode: fan_adv_kick() pushes it
+ * CONFIG_FAN_ADV_FAST_WINDOW_MS into the future and every (re)start
+ * advertises fast with a duration of whatever is left of it. When the
+ * controller ends that run, BLE_GAP_EVENT_ADV_COMPLETE comes back through
+ * fan_adv_resume(), which finds the deadline passed and restarts at the
+ * slow interval with no time limit. A connection that forms during the fast
+ * phase does not use it up: resuming afterwards continues the same window.
+ *
+ * Losing the remote puts a reconnect in front of that. A high duty cycle
+ * directed burst (every 3.75 ms or less, 1.28 s at most) addressed to the
+ * remote comes first: a central that is scanning connects on the first
+ * packet it hears. Directed advertising needs the remote to be scanning with
+ * the right filter, so when the burst ends the fan advertises normally at
+ * the fast interval for CONFIG_FAN_ADV_RECONNECT_WINDOW_MS but lets only
+ * the remote (the accept list) connect. After that everyone is welcome
+ * again. The time from the drop to the remote's next connection is logged.
+ *
+ * The status beacon is kept as the AD structure it goes out as. A change
+ * rewrites the advertised data in place, no restart. Updates come from
+ * other tasks: every writer loops until the record generation it wrote is
+ * still the latest, so the controller never keeps a stale one.
+ *
+ * With legacy advertising there is one set; the beacon is its scan
+ * response. With extended advertising there are two, each with its own
+ * parameters:
+ *     o the control set (connectable): the phases above, the fan identity
+ *       and name only, so a controller finds it fast and the packets stay
+ *       short;
+ *     o the beacon set (non-connectable, non-scannable): the beacon every
+ *       CONFIG_FAN_ADV_BEACON_ITVL_MS, from host sync on. It keeps running
+ *       while the connection table is full.
+ * With periodic advertising enabled the beacon set also carries a periodic
+ * train with the beacon every CONFIG_FAN_ADV_PERIODIC_ITVL_MS. Any number
+ * of observers can sync to it and follow the state with no connection and
+ * no scan requests.
+ *
+ * Advertising data is encoded once and cached, and the controller keeps
+ * what it was given across restarts. A restart after a connect, disconnect
+ * or ADV_COMPLETE only sets the parameters and enables the advertiser. The
+ * data goes out again only when it changes (the device name or the beacon)
+ * or after a host reset, which also resets the controller. The one exception
+ * is the extended control set after a directed burst: a directed PDU carries
+ * no data, and the controller will not turn a set that holds data into one,
+ * so the set is removed first and its data loaded again afterwards.
+ *
+ * All calls come from the NimBLE host task, except fan_adv_set_beacon().
+ */
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "host/ble_hs.h"
+#include "services/gap/ble_svc_gap.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "conn_table.h"
+#include "fan_adv.h"
+
+static const char *TAG = "fan_adv";
+
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+#define CTRL_INSTANCE   0
+#define CTRL_SID        1
+#define BEACON_INSTANCE 1
+
+#if CONFIG_BT_NIMBLE_MAX_EXT_ADV_INSTANCES < 2
+#error "the control and beacon sets need BT_NIMBLE_MAX_EXT_ADV_INSTANCES >= 2"
+#endif
+
+#if CONFIG_BT_NIMBLE_ENABLE_PERIODIC_ADV
+#define FAN_ADV_TRAIN   1
+#endif
+
+/* Follows the flags and the fan identity */
+static const uint8_t ext_adv_name[] = {
+    0x11, 0X09, 'A', 'i', 'r', 'S', 'h', 'f', 't', '-', 'F', 'A', 'N', '-', 'e', 'x', 't',
+};
+#endif
+
+/* A run shorter than this is not worth starting fast */
+#define FAST_MIN_MS     10
+
+/* Longest a high duty cycle directed run may last */
+#define DIRECTED_MS     1280
+
+typedef enum {
+    RUN_OPEN,           /* undirected, anyone may connect */
+    RUN_DIRECTED,       /* high duty cycle, directed at s_peer */
+    RUN_ACCEPT_LIST,    /* undirected, only the accept list may connect */
+} adv_run_t;
+
+static const char *const s_run_name[] = { "open", "directed", "accept list" };
+
+static uint8_t s_own_addr_type;
+static ble_gap_event_fn *s_gap_cb;
+static int64_t s_fast_until;        /* esp_timer time the fast phase ends */
+static bool s_fast;                 /* the running advertising is the fast one */
+
+/* Reconnect of the remote */
+static adv_run_t s_mode = RUN_OPEN; /* RUN_OPEN once the remote is back */
+static ble_addr_t s_peer;
+static int64_t s_lost_at;           /* when it dropped; 0 = not waiting */
+static int64_t s_accept_until;
+
+static struct {
+    uint32_t count;
+    uint32_t last_ms;
+    uint32_t best_ms;
+    uint32_t worst_ms;
+} s_reconnects;
+
+/* Flags and fan identity AD structures, the start of the connectable
+ * advertising data */
+#define IDENT_AD_LEN    (4 + sizeof(fan_ident_t))
+#define ADV_HEAD_LEN    (FAN_IDENT_OFFSET + IDENT_AD_LEN)
+
+static fan_ident_t s_ident;
+
+/* Status beacon AD structure: length, type, company ID, record */
+#define BEACON_AD_LEN   (4 + sizeof(fan_beacon_t))
+
+static fan_beacon_t s_beacon = { .version = FAN_BEACON_VERSION };
+static volatile uint32_t s_beacon_gen;  /* bumped on every change */
+static portMUX_TYPE s_beacon_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* What the controller holds; fan_adv_init() forgets it on every sync */
+static bool s_beacon_loaded;
+static uint32_t s_beacon_loaded_gen;    /* generation it holds */
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+static bool s_ctrl_loaded;              /* the control set's data */
+#endif
+
+/* Write the flags and the fan identity into `ad`: ADV_HEAD_LEN bytes */
+static void adv_head(uint8_t *ad)
+{
+    ad[0] = 2;
+    ad[1] = BLE_HS_ADV_TYPE_FLAGS;
+    ad[2] = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+
+    ad += FAN_IDENT_OFFSET;
+    ad[0] = IDENT_AD_LEN - 1;
+    ad[1] = BLE_HS_ADV_TYPE_MFG_DATA;
+    ad[2] = FAN_ADV_COMPANY_ID & 0xff;
+    ad[3] = FAN_ADV_COMPANY_ID >> 8;
+    memcpy(&ad[4], &s_ident, sizeof(s_ident));
+}
+
+/* Copy the beacon AD structure into `ad`; returns its generation */
+static uint32_t beacon_ad(uint8_t *ad)
+{
+    uint32_t gen;
+
+    ad[0] = BEACON_AD_LEN - 1;
+    ad[1] = BLE_HS_ADV_TYPE_MFG_DATA;
+    ad[2] = FAN_ADV_COMPANY_ID & 0xff;
+    ad[3] = FAN_ADV_COMPANY_ID >> 8;
+    portENTER_CRITICAL(&s_beacon_mux);
+    memcpy(&ad[4], &s_beacon, sizeof(s_beacon));
+    gen = s_beacon_gen;
+    portEXIT_CRITICAL(&s_beacon_mux);
+    return gen;
+}
+
+static bool adv_active(void)
+{
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    return ble_gap_ext_adv_active(CTRL_INSTANCE);
+#else
+    return ble_gap_adv_active();
+#endif
+}
+
+static void adv_stop(void)
+{
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    ble_gap_ext_adv_stop(CTRL_INSTANCE);
+#else
+    ble_gap_adv_stop();
+#endif
+}
+
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+/* Copy `len` bytes of AD structures into a new mbuf for the ext adv API */
+static struct os_mbuf *ad_mbuf(const uint8_t *ad, uint16_t len)
+{
+    struct os_mbuf *om = os_msys_get_pkthdr(len, 0);
+
+    if (om != NULL && os_mbuf_append(om, ad, len) != 0) {
+        os_mbuf_free_chain(om);
+        om = NULL;
+    }
+    return om;
+}
+
+/* Set the beacon set's data, and its periodic train's: the beacon */
+static int beacon_set_data(void)
+{
+    uint8_t ad[BEACON_AD_LEN];
+    struct os_mbuf *om;
+    uint32_t gen = beacon_ad(ad);
+    int rc;
+
+    om = ad_mbuf(ad, sizeof(ad));
+    if (om == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+    rc = ble_gap_ext_adv_set_data(BEACON_INSTANCE, om);
+#if FAN_ADV_TRAIN
+    if (rc == 0) {
+        om = ad_mbuf(ad, sizeof(ad));
+        if (om == NULL) {
+            return BLE_HS_ENOMEM;
+        }
+#if CONFIG_BT_NIMBLE_PERIODIC_ADV_ENH
+        rc = ble_gap_periodic_adv_set_data(BEACON_INSTANCE, om, NULL);
+#else
+        rc = ble_gap_periodic_adv_set_data(BEACON_INSTANCE, om);
+#endif
+    }
+#endif
+    if (rc != 0) {
+        return rc;
+    }
+    s_beacon_loaded = true;
+    s_beacon_loaded_gen = gen;
+    return gen == s_beacon_gen ? 0 : BLE_HS_EAGAIN;
+}
+#else
+/* Set the scan response: the beacon */
+static int beacon_set_data(void)
+{
+    uint8_t ad[BEACON_AD_LEN];
+    uint32_t gen = beacon_ad(ad);
+    int rc = ble_gap_adv_rsp_set_data(ad, sizeof(ad));
+
+    if (rc != 0) {
+        return rc;
+    }
+    s_beacon_loaded = true;
+    s_beacon_loaded_gen = gen;
+    return gen == s_beacon_gen ? 0 : BLE_HS_EAGAIN;
+}
+#endif
+
+/* Write the latest beacon, again if it changed meanwhile */
+static int beacon_push(void)
+{
+    int rc;
+
+    do {
+        rc = beacon_set_data();
+    } while (rc == BLE_HS_EAGAIN);
+    return rc;
+}
+
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+/**
+ * Extended advertising, control set:
+ *     o Connectable, 1M primary / 2M secondary PHY.
+ *     o Flags, fan identity and name in the advertising data, loaded once.
+ *     o RUN_DIRECTED: a legacy high duty cycle directed PDU without data.
+ *       A set holding data cannot be reconfigured to it (HCI 0x12), so it
+ *       is removed first and reloaded on the next undirected start.
+ * `duration_ms` of 0 advertises until stopped.
+ */
+static int
+adv_start(adv_run_t run, uint32_t itvl_ms, int32_t duration_ms)
+{
+    struct ble_gap_ext_adv_params params;
+    uint8_t ad[ADV_HEAD_LEN + sizeof(ext_adv_name)];
+    struct os_mbuf *data;
+    int rc;
+
+    /* use defaults for non-set params */
+    memset(&params, 0, sizeof(params));
+
+    /* enable connectable advertising */
+    params.connectable = 1;
+    params.own_addr_type = s_own_addr_type;
+    params.primary_phy = BLE_HCI_LE_PHY_1M;
+    params.secondary_phy = BLE_HCI_LE_PHY_2M;
+    params.tx_power = 127;
+    params.sid = CTRL_SID;
+    params.itvl_min = BLE_GAP_ADV_ITVL_MS(itvl_ms);
+    params.itvl_max = BLE_GAP_ADV_ITVL_MS(itvl_ms + itvl_ms / 4);
+    if (run == RUN_DIRECTED) {
+        params.legacy_pdu = 1;
+        params.directed = 1;
+        params.high_duty_directed = 1;
+        params.peer = s_peer;
+        params.secondary_phy = BLE_HCI_LE_PHY_1M;
+    } else if (run == RUN_ACCEPT_LIST) {
+        params.filter_policy = BLE_HCI_ADV_FILT_CONN;
+    }
+
+    if (run == RUN_DIRECTED && s_ctrl_loaded) {
+        rc = ble_gap_ext_adv_remove(CTRL_INSTANCE);
+        if (rc != 0) {
+            return rc;
+        }
+        s_ctrl_loaded = false;
+    }
+
+    rc = ble_gap_ext_adv_configure(CTRL_INSTANCE, &params, NULL, s_gap_cb, NULL);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (run != RUN_DIRECTED && !s_ctrl_loaded) {
+        adv_head(ad);
+        memcpy(&ad[ADV_HEAD_LEN], ext_adv_name, sizeof(ext_adv_name));
+        data = ad_mbuf(ad, sizeof(ad));
+        if (data == NULL) {
+            return BLE_HS_ENOMEM;
+        }
+        rc = ble_gap_ext_adv_set_data(CTRL_INSTANCE, data);
+        if (rc != 0) {
+            return rc;
+        }
+        s_ctrl_loaded = true;
+    }
+
+    /* duration is in 10 ms units */
+    return ble_gap_ext_adv_start(CTRL_INSTANCE, duration_ms / 10, 0);
+}
+#else
+/* Encoded advertising data, and the device name it was encoded with */
+static uint8_t s_adv_data[BLE_HS_ADV_MAX_SZ];
+static uint8_t s_adv_len;
+static char s_adv_name[BLE_HS_ADV_MAX_SZ + 1];
+static bool s_adv_loaded;               /* the controller has s_adv_data */
+
+/**
+ * Legacy advertising data:
+ *     o General discoverable mode.
+ *     o BLE-only (BR/EDR unsupported).
+ *     o The fan identity, at FAN_IDENT_OFFSET.
+ *     o Tx power and name.
+ * Encoded again only if the device name changed or after fan_adv_init(),
+ * and loaded into the controller only if it does not have it yet.
+ */
+static int
+adv_data_load(void)
+{
+    struct ble_hs_adv_fields fields;
+#if CONFIG_BT_NIMBLE_GAP_SERVICE
+    const char *name = ble_svc_gap_device_name();
+#else
+    const char *name = "";
+#endif
+    uint8_t len;
+    int rc;
+
+    if (s_adv_len == 0 || strncmp(name, s_adv_name, sizeof(s_adv_name) - 1) != 0) {
+        /* flags and identity first, so the identity has a fixed offset */
+        adv_head(s_adv_data);
+
+        memset(&fields, 0, sizeof fields);
+
+        /* Have the stack fill in the tx power level */
+        fields.tx_pwr_lvl_is_present = 1;
+        fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
+
+#if CONFIG_BT_NIMBLE_GAP_SERVICE
+        fields.name = (uint8_t *)name;
+        fields.name_len = strlen(name);
+        fields.name_is_complete = 1;
+#endif
+
+        rc = ble_hs_adv_set_fields(&fields, &s_adv_data[ADV_HEAD_LEN], &len,
+                                   sizeof(s_adv_data) - ADV_HEAD_LEN);
+        if (rc != 0) {
+            s_adv_len = 0;
+            return rc;
+        }
+        s_adv_len = ADV_HEAD_LEN + len;
+        strncpy(s_adv_name, name, sizeof(s_adv_name) - 1);
+        s_adv_loaded = false;
+    }
+
+    if (!s_adv_loaded) {
+        rc = ble_gap_adv_set_data(s_adv_data, s_adv_len);
+        if (rc != 0) {
+            return rc;
+        }
+        s_adv_loaded = true;
+    }
+    return 0;
+}
+
+/**
+ * Legacy advertising:
+ *     o Undirected connectable mode with the cached advertising data.
+ *     o The status beacon in the scan response.
+ *     o RUN_DIRECTED: high duty cycle directed connectable mode instead.
+ * `duration_ms` of 0 advertises until stopped.
+ */
+static int
+adv_start(adv_run_t run, uint32_t itvl_ms, int32_t duration_ms)
+{
+    struct ble_gap_adv_params adv_params;
+    int rc;
+
+    if (run == RUN_DIRECTED) {
+        memset(&adv_params, 0, sizeof adv_params);
+        adv_params.conn_mode = BLE_GAP_CONN_MODE_DIR;
+        adv_params.disc_mode = BLE_GAP_DISC_MODE_NON;
+        adv_params.high_duty_cycle = 1;
+        return ble_gap_adv_start(s_own_addr_type, &s_peer, duration_ms,
+                                 &adv_params, s_gap_cb, NULL);
+    }
+
+    rc = adv_data_load();
+    if (rc != 0) {
+        return rc;
+    }
+    if (!s_beacon_loaded || s_beacon_loaded_gen != s_beacon_gen) {
+        rc = beacon_push();
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    memset(&adv_params, 0, sizeof adv_params);
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    adv_params.itvl_min = BLE_GAP_ADV_ITVL_MS(itvl_ms);
+    adv_params.itvl_max = BLE_GAP_ADV_ITVL_MS(itvl_ms + itvl_ms / 4);
+    if (run == RUN_ACCEPT_LIST) {
+        adv_params.filter_policy = BLE_HCI_ADV_FILT_CONN;
+    }
+    return ble_gap_adv_start(s_own_addr_type, NULL,
+                             duration_ms ? duration_ms : BLE_HS_FOREVER,
+                             &adv_params, s_gap_cb, NULL);
+}
+#endif
+
+/* The remote's identity address, if it is one directed advertising and the
+ * accept list can use: a bonded peer's, or a public or static random
+ * address that stays the same from one connection to the next. */
+static bool peer_addr_stable(const struct ble_gap_conn_desc *desc)
+{
+    const ble_addr_t *a = &desc->peer_id_addr;
+
+    if (desc->sec_state.bonded) {
+        return true;
+    }
+    return a->type == BLE_ADDR_PUBLIC ||
+           (a->type == BLE_ADDR_RANDOM && (a->val[5] & 0xc0) == 0xc0);
+}
+
+/* Advertise at the fast interval for `left_ms`, connectable by the remote
+ * only */
+static int accept_list_start(int64_t left_ms)
+{
+    int rc = ble_gap_wl_set(&s_peer, 1);
+    if (rc != 0) {
+        return rc;
+    }
+    return adv_start(RUN_ACCEPT_LIST, CONFIG_FAN_ADV_FAST_ITVL_MS, (int32_t)left_ms);
+}
+
+void fan_adv_resume(void)
+{
+    int rc;
+
+    if (s_gap_cb == NULL || !conn_table_has_room() || adv_active()) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (s_mode == RUN_DIRECTED) {
+        /* the burst is over without the remote */
+        s_mode = RUN_ACCEPT_LIST;
+        s_accept_until = now + (int64_t)CONFIG_FAN_ADV_RECONNECT_WINDOW_MS * 1000;
+    }
+    if (s_mode == RUN_ACCEPT_LIST) {
+        int64_t left_ms = (s_accept_until - now) / 1000;
+        if (left_ms >= FAST_MIN_MS) {
+            rc = accept_list_start(left_ms);
+            if (rc == 0) {
+                s_fast = true;
+                ESP_LOGI(TAG, "advertising fast, remote only");
+                return;
+            }
+            ESP_LOGE(TAG, "error enabling accept list advertising; rc=%d", rc);
+        }
+        s_mode = RUN_OPEN;
+    }
+
+    int64_t left_ms = (s_fast_until - now) / 1000;
+    s_fast = left_ms >= FAST_MIN_MS;
+    if (s_fast) {
+        rc = adv_start(RUN_OPEN, CONFIG_FAN_ADV_FAST_ITVL_MS, (int32_t)left_ms);
+    } else {
+        rc = adv_start(RUN_OPEN, CONFIG_FAN_ADV_SLOW_ITVL_MS, 0);
+    }
+    if (rc != 0) {
+        ESP_LOGE(TAG, "error enabling advertisement; rc=%d", rc);
+        return;
+    }
+    ESP_LOGI(TAG, "advertising %s", s_fast ? "fast" : "slow");
+}
+
+void fan_adv_kick(void)
+{
+    s_fast_until = esp_timer_get_time() + (int64_t)CONFIG_FAN_ADV_FAST_WINDOW_MS * 1000;
+    if (adv_active() && !s_fast) {
+        adv_stop();     /* no ADV_COMPLETE for a stop we asked for */
+    }
+    fan_adv_resume();
+}
+
+void fan_adv_reconnect(const struct ble_gap_conn_desc *desc)
+{
+    int rc;
+
+    if (s_gap_cb == NULL || !peer_addr_stable(desc)) {
+        fan_adv_kick();
+        return;
+    }
+
+    s_peer = desc->peer_id_addr;
+    s_lost_at = esp_timer_get_time();
+    s_fast_until = s_lost_at + (int64_t)CONFIG_FAN_ADV_FAST_WINDOW_MS * 1000;
+    if (adv_active()) {
+        adv_stop();
+    }
+
+    s_mode = RUN_DIRECTED;
+    s_fast = true;
+    rc = adv_start(RUN_DIRECTED, 0, DIRECTED_MS);
+    if (rc == 0) {
+        ESP_LOGI(TAG, "advertising directed to the remote");
+        return;
+    }
+    /* e.g. the controller cannot do high duty cycle: go on to the accept
+     * list at once */
+    ESP_LOGW(TAG, "error enabling directed advertisement; rc=%d", rc);
+    fan_adv_resume();
+}
+
+void fan_adv_on_connect(const struct ble_gap_conn_desc *desc)
+{
+    if (s_lost_at == 0 || ble_addr_cmp(&desc->peer_id_addr, &s_peer) != 0) {
+        return;
+    }
+
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - s_lost_at) / 1000);
+    s_reconnects.count++;
+    s_reconnects.last_ms = ms;
+    if (s_reconnects.count == 1 || ms < s_reconnects.best_ms) {
+        s_reconnects.best_ms = ms;
+    }
+    if (ms > s_reconnects.worst_ms) {
+        s_reconnects.worst_ms = ms;
+    }
+    ESP_LOGI(TAG, "remote back in %u ms (%s); %u reconnects, best %u ms, worst %u ms",
+             (unsigned)ms, s_run_name[s_mode], (unsigned)s_reconnects.count,
+             (unsigned)s_reconnects.best_ms, (unsigned)s_reconnects.worst_ms);
+
+    s_lost_at = 0;
+    s_mode = RUN_OPEN;
+}
+
+void fan_adv_set_beacon(const fan_beacon_t *state)
+{
+    bool changed;
+
+    portENTER_CRITICAL(&s_beacon_mux);
+    changed = s_beacon.power != state->power || s_beacon.light != state->light ||
+              s_beacon.wifi != state->wifi || s_beacon.rpm != state->rpm ||
+              s_beacon.angle != state->angle;
+    if (changed) {
+        s_beacon.power = state->power;
+        s_beacon.light = state->light;
+        s_beacon.wifi = state->wifi;
+        s_beacon.rpm = state->rpm;
+        s_beacon.angle = state->angle;
+        s_beacon.seq++;
+        s_beacon_gen++;
+    }
+    portEXIT_CRITICAL(&s_beacon_mux);
+
+    /* before sync the next adv_start() writes it */
+    if (!changed || s_gap_cb == NULL) {
+        return;
+    }
+    int rc = beacon_push();
+    if (rc != 0) {
+        ESP_LOGD(TAG, "beacon not updated; rc=%d", rc);
+    }
+}
+
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+/**
+ * Extended advertising, beacon set:
+ *     o Non-connectable, non-scannable, 1M PHY, at
+ *       CONFIG_FAN_ADV_BEACON_ITVL_MS with no time limit.
+ *     o The status beacon as its data.
+ *     o With periodic advertising, a periodic train every
+ *       CONFIG_FAN_ADV_PERIODIC_ITVL_MS with the beacon as its data.
+ */
+static int
+beacon_set_start(void)
+{
+    struct ble_gap_ext_adv_params params;
+    int rc;
+
+    memset(&params, 0, sizeof(params));
+    params.own_addr_type = s_own_addr_type;
+    params.primary_phy = BLE_HCI_LE_PHY_1M;
+    params.secondary_phy = BLE_HCI_LE_PHY_1M;
+    params.tx_power = 127;
+    params.sid = FAN_ADV_BEACON_SID;
+    params.itvl_min = BLE_GAP_ADV_ITVL_MS(CONFIG_FAN_ADV_BEACON_ITVL_MS);
+    params.itvl_max = BLE_GAP_ADV_ITVL_MS(CONFIG_FAN_ADV_BEACON_ITVL_MS +
+                                          CONFIG_FAN_ADV_BEACON_ITVL_MS / 4);
+
+    rc = ble_gap_ext_adv_configure(BEACON_INSTANCE, &params, NULL, NULL, NULL);
+    if (rc != 0) {
+        return rc;
+    }
+
+#if FAN_ADV_TRAIN
+    struct ble_gap_periodic_adv_params pparams;
+    memset(&pparams, 0, sizeof(pparams));
+    pparams.itvl_min = BLE_GAP_PERIODIC_ITVL_MS(CONFIG_FAN_ADV_PERIODIC_ITVL_MS);
+    pparams.itvl_max = pparams.itvl_min;
+    rc = ble_gap_periodic_adv_configure(BEACON_INSTANCE, &pparams);
+    if (rc != 0) {
+        return rc;
+    }
+#endif
+
+    rc = beacon_push();
+    if (rc != 0) {
+        return rc;
+    }
+
+#if FAN_ADV_TRAIN
+#if CONFIG_BT_NIMBLE_PERIODIC_ADV_ENH
+    struct ble_gap_periodic_adv_enable_params eparams;
+    memset(&eparams, 0, sizeof(eparams));
+    rc = ble_gap_periodic_adv_start(BEACON_INSTANCE, &eparams);
+#else
+    rc = ble_gap_periodic_adv_start(BEACON_INSTANCE);
+#endif
+    if (rc != 0) {
+        return rc;
+    }
+#endif
+    return ble_gap_ext_adv_start(BEACON_INSTANCE, 0, 0);
+}
+#endif
+
+void fan_adv_init(uint8_t own_addr_type, const fan_ident_t *ident,
+                  ble_gap_event_fn *gap_cb)
+{
+    s_own_addr_type = own_addr_type;
+    s_gap_cb = gap_cb;
+    s_ident = *ident;
+#if FAN_ADV_TRAIN
+    s_ident.caps |= FAN_IDENT_CAP_TRAIN;
+#endif
+
+    /* the host reset the controller: nothing is loaded */
+    s_beacon_loaded = false;
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    s_ctrl_loaded = false;
+
+    int rc = beacon_set_start();
+    if (rc != 0) {
+        ESP_LOGE(TAG, "error starting the beacon set; rc=%d", rc);
+        return;
+    }
+#if FAN_ADV_TRAIN
+    ESP_LOGI(TAG, "beacon every %d ms, periodic train every %d ms",
+             CONFIG_FAN_ADV_BEACON_ITVL_MS, CONFIG_FAN_ADV_PERIODIC_ITVL_MS);
+#else
+    ESP_LOGI(TAG, "beacon every %d ms", CONFIG_FAN_ADV_BEACON_ITVL_MS);
+#endif
+#else
+    s_adv_len = 0;          /* encode again with this identity */
+    s_adv_loaded = false;
+#endif
+}
@@ -0,0 +1,91 @@
+#pragma once
+/* conn_table.h
+ * One context per open connection, found in O(1) by connection handle.
+ * Sized by CONFIG_FAN_MAX_CONNECTIONS; advertising is only kept up while
+ * there is a free entry. Shared by both fan projects; fields one of them
+ * does not use stay zero.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONN_TABLE_MAX CONFIG_FAN_MAX_CONNECTIONS
+
+/* LL payload size before and after Data Length Extension, and the packet
+ * time that fits the largest payload on the 1M PHY */
+#define CONN_LL_OCTETS_DFLT 27
+#define CONN_LL_OCTETS_MAX  251
+#define CONN_LL_TIME_MAX    2120
+
+/* What kind of client is on the other end, as far as the fan can tell */
+typedef enum {
+    CONN_ROLE_UNKNOWN = 0,  /* has not written a control yet */
+    CONN_ROLE_REMOTE,       /* the remote: sequenced channel or known address */
+    CONN_ROLE_PHONE,        /* writes the plain control characteristics */
+} conn_role_t;
+
+typedef struct {
+    uint32_t rx_writes;     /* characteristic writes received */
+    uint32_t tx_notify;     /* notifications the host sent */
+    uint32_t tx_fail;       /* notifications the host reported as failed */
+} conn_stats_t;
+
+typedef struct {
+    bool        in_use;
+    uint16_t    conn_handle;
+    uint16_t    mtu;
+    conn_role_t role;
+    int64_t     last_activity_us;   /* esp_timer time of the last write */
+    conn_stats_t stats;
+
+    /* link layer, from PHY_UPDATE_COMPLETE and DATA_LEN_CHG */
+    uint8_t     tx_phy;         /* BLE_HCI_LE_PHY_* */
+    uint8_t     rx_phy;
+    uint16_t    tx_octets;      /* largest LL payload in each direction */
+    uint16_t    rx_octets;
+
+    /* status notify queue, owned by the project's notify code (bit i =
+     * its notify slot i) */
+    uint32_t    subs;
+    uint32_t    queued;         /* slots waiting to be sent */
+    bool        busy;           /* a sender is draining this entry */
+
+    /* connection parameters (WifiBLE conn_params.c), under its lock */
+    uint16_t    conn_itvl;      /* current interval, 1.25 ms units */
+    uint16_t    conn_latency;   /* current peripheral latency */
+    uint8_t     params_want;    /* profile the policy wants */
+    uint8_t     params_sent;    /* profile last requested */
+    bool        params_busy;    /* an update procedure is in progress */
+
+    /* sequenced control channel (WifiBLE gatt_svr.c), under s_state_mux */
+    bool        ctrl_open;
+    uint16_t    ctrl_ack;
+} conn_ctx_t;
+
+/* Take an entry for a new connection. Host task only. Returns NULL when the
+ * table is full. */
+conn_ctx_t *conn_table_add(uint16_t conn_handle);
+
+/* Release the entry of a closed connection. Host task only. */
+void conn_table_remove(uint16_t conn_handle);
+
+/* Context of `conn_handle`, or NULL if it is not in the table */
+conn_ctx_t *conn_table_get(uint16_t conn_handle);
+
+/* Entry `i` (0 <= i < CONN_TABLE_MAX) if it is in use, else NULL. For
+ * walking every connection. */
+conn_ctx_t *conn_table_at(int i);
+
+int  conn_table_count(void);
+bool conn_table_has_room(void);
+
+/* A write arrived on `conn_handle`: stamp the activity time and count it */
+void conn_table_touch(uint16_t conn_handle);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,114 @@
+#pragma once
+/* fan_adv.h
+ * Connectable advertising for the fan. Advertising runs at a fast interval
+ * for CONFIG_FAN_ADV_FAST_WINDOW_MS after boot, after a disconnect or when
+ * asked to, then falls back to a slow interval until the next kick. It only
+ * runs while the connection table has room.
+ *
+ * When the remote drops, the fan first advertises directed at it and then
+ * for a while to it alone, so it can reconnect without competing with
+ * anyone; see fan_adv.c.
+ */
+#include <stdint.h>
+#include "host/ble_gap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Status beacon: a manufacturer specific AD structure (company ID
+ * FAN_ADV_COMPANY_ID) so observers can read the fan state without
+ * connecting. With legacy advertising it is the scan response. With
+ * extended advertising it is the data of a separate non-connectable beacon
+ * set (SID FAN_ADV_BEACON_SID), and of that set's periodic train if there
+ * is one. Little-endian, packed; new fields are only ever appended and
+ * bump FAN_BEACON_VERSION.
+ *
+ *     ver power light wifi rpm(4) angle(4) seq(2)   -> 14 bytes
+ */
+#define FAN_ADV_COMPANY_ID      0xFFFF  /* Bluetooth SIG test ID */
+#define FAN_BEACON_VERSION      1
+#define FAN_ADV_BEACON_SID      2
+
+/* `wifi` values */
+#define FAN_BEACON_WIFI_NONE            0   /* no Wi-Fi, or not provisioned */
+#define FAN_BEACON_WIFI_CONNECTING      1
+#define FAN_BEACON_WIFI_CONNECTED       2   /* has an IP address */
+#define FAN_BEACON_WIFI_DISCONNECTED    3
+
+typedef struct __attribute__((packed)) {
+    uint8_t  version;   /* FAN_BEACON_VERSION */
+    uint8_t  power;
+    uint8_t  light;
+    uint8_t  wifi;      /* FAN_BEACON_WIFI_* */
+    uint32_t rpm;
+    uint32_t angle;
+    uint16_t seq;       /* incremented whenever the record changes */
+} fan_beacon_t;
+
+_Static_assert(sizeof(fan_beacon_t) == 14, "fan_beacon_t is a wire format");
+
+/* Fan identity: a manufacturer specific AD structure (company ID
+ * FAN_ADV_COMPANY_ID) right after the flags of the connectable advertising,
+ * at FAN_IDENT_OFFSET, so a remote recognises a fan with one fixed-offset
+ * compare instead of parsing the data. Its length tells it apart from the
+ * beacon. Packed; never changes size.
+ *
+ *     model caps state_version                      -> 3 bytes
+ */
+#define FAN_IDENT_OFFSET        3       /* after the flags AD structure */
+
+/* `model` values */
+#define FAN_IDENT_MODEL_BASIC   1       /* BLE only */
+#define FAN_IDENT_MODEL_WIFI    2       /* BLE and Wi-Fi */
+
+/* `caps` bits */
+#define FAN_IDENT_CAP_PACKET    (1u << 0)   /* sequenced packet characteristic */
+#define FAN_IDENT_CAP_STATUS    (1u << 1)   /* aggregate status record */
+#define FAN_IDENT_CAP_PROFILE   (1u << 2)   /* speed profiles */
+#define FAN_IDENT_CAP_PRESET    (1u << 3)   /* stored presets */
+#define FAN_IDENT_CAP_WIFI      (1u << 4)
+#define FAN_IDENT_CAP_TRAIN     (1u << 5)   /* periodic status train; set here */
+
+typedef struct __attribute__((packed)) {
+    uint8_t model;          /* FAN_IDENT_MODEL_* */
+    uint8_t caps;           /* FAN_IDENT_CAP_* */
+    uint8_t state_version;  /* version of the status record served, 0 = none */
+} fan_ident_t;
+
+_Static_assert(sizeof(fan_ident_t) == 3, "fan_ident_t is a wire format");
+
+/* Called from the host sync callback once the own address type is known.
+ * `ident` is copied into the advertising data. Connections formed by the
+ * advertising report to `gap_cb`. With extended advertising this also
+ * starts the beacon set, which runs from then on. */
+void fan_adv_init(uint8_t own_addr_type, const fan_ident_t *ident,
+                  ble_gap_event_fn *gap_cb);
+
+/* Enter the fast phase and (re)start advertising. Used at boot, after a
+ * disconnect and whenever reconnects should be quick again. */
+void fan_adv_kick(void);
+
+/* Start advertising in the current phase unless it is already running or
+ * the connection table is full. Call after a connection forms or
+ * BLE_GAP_EVENT_ADV_COMPLETE (the end of the fast phase lands here too). */
+void fan_adv_resume(void);
+
+/* The remote on the connection `desc` described has dropped: advertise
+ * directed at it, then let only it connect, then carry on as after a kick.
+ * Needs an address it keeps (bonded, public or static); otherwise this is
+ * fan_adv_kick(). */
+void fan_adv_reconnect(const struct ble_gap_conn_desc *desc);
+
+/* A connection formed. If it is the remote coming back, report how long it
+ * took and open advertising to everyone again. Call before fan_adv_resume(). */
+void fan_adv_on_connect(const struct ble_gap_conn_desc *desc);
+
+/* The fan state the beacon shows. `version` and `seq` are filled in here.
+ * The advertised data is only rewritten when the record differs from the
+ * last one. Callable from any task, also before fan_adv_init(). */
+void fan_adv_set_beacon(const fan_beacon_t *state);
+
+#ifdef __cplusplus
+}
+#endif
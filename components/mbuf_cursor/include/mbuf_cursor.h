@@ -0,0 +1,106 @@
+#pragma once
+/* mbuf_cursor.h
+ * Sequential reader over an os_mbuf chain. Fields are read straight out of
+ * the segments, crossing segment boundaries as needed, so parsers never
+ * have to flatten a packet into a stack buffer first.
+ *
+ * Header-only; shared by the fan and the remote.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "host/ble_hs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    const struct os_mbuf *m;    /* current segment, NULL at the end */
+    uint16_t off;               /* offset inside m */
+    uint16_t left;              /* bytes left in the whole chain */
+} mbuf_cursor_t;
+
+static inline void mbuf_cursor_init(mbuf_cursor_t *c, const struct os_mbuf *om)
+{
+    c->m = om;
+    c->off = 0;
+    c->left = om ? OS_MBUF_PKTLEN(om) : 0;
+}
+
+static inline uint16_t mbuf_cursor_left(const mbuf_cursor_t *c)
+{
+    return c->left;
+}
+
+/* Skip empty / exhausted segments so c->m points at the next byte */
+static inline void mbuf_cursor_settle(mbuf_cursor_t *c)
+{
+    while (c->m && c->off >= c->m->om_len) {
+        c->m = SLIST_NEXT(c->m, om_next);
+        c->off = 0;
+    }
+}
+
+/* Copy `len` bytes (dst may be NULL to skip). Returns 0, or -1 without
+ * consuming anything if fewer than `len` bytes are left. */
+static inline int mbuf_cursor_read(mbuf_cursor_t *c, void *dst, uint16_t len)
+{
+    uint8_t *out = (uint8_t *)dst;
+
+    if (len > c->left) {
+        return -1;
+    }
+    c->left -= len;
+    while (len) {
+        mbuf_cursor_settle(c);
+        uint16_t n = c->m->om_len - c->off;
+        if (n > len) {
+            n = len;
+        }
+        if (out) {
+            memcpy(out, c->m->om_data + c->off, n);
+            out += n;
+        }
+        c->off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static inline int mbuf_cursor_skip(mbuf_cursor_t *c, uint16_t len)
+{
+    return mbuf_cursor_read(c, NULL, len);
+}
+
+static inline int mbuf_cursor_u8(mbuf_cursor_t *c, uint8_t *out)
+{
+    if (c->left == 0) {
+        return -1;
+    }
+    mbuf_cursor_settle(c);
+    *out = c->m->om_data[c->off++];
+    c->left--;
+    return 0;
+}
+
+/* Little-endian unsigned integer of 1..4 bytes */
+static inline int mbuf_cursor_le(mbuf_cursor_t *c, uint8_t len, uint32_t *out)
+{
+    uint32_t x = 0;
+    uint8_t b;
+
+    if (len < 1 || len > sizeof(uint32_t) || len > c->left) {
+        return -1;
+    }
+    for (uint8_t i = 0; i < len; i++) {
+        mbuf_cursor_u8(c, &b);
+        x |= (uint32_t)b << (8 * i);
+    }
+    *out = x;
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -21,6 +21,7 @@
 #include <stdbool.h>
 #include "nimble/ble.h"
 #include "modlog/modlog.h"
+#include "wifi_manager.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -33,6 +34,21 @@ struct ble_gatt_register_ctxt;
 
 void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
 int gatt_svr_init(void);
+
+struct fan_state;
+/* fan_actuator applied-state callback: updates and notifies the status service */
+void gatt_svr_status_applied(const struct fan_state *applied);
+
+/* wifi_manager state callback: shows the Wi-Fi state in the status beacon */
+void gatt_svr_wifi_state(wifi_mgr_state_t state);
+
+/* GAP event hooks: track which connection is subscribed to which status
+ * characteristic so status updates skip all notify work when nobody is,
+ * and count each connection's sent and failed notifications. The
+ * connection must still be in conn_table when on_disconnect runs. */
+void gatt_svr_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
+void gatt_svr_on_disconnect(uint16_t conn_handle);
+void gatt_svr_on_notify_tx(uint16_t conn_handle, uint16_t attr_handle, int status);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,273 @@
+/* conn_params.c
+ * Connection parameter policy.
+ *
+ * Each connection is asked for one of the profiles below. The central's own
+ * choice (PROFILE_NONE) counts as active, so a new client discovers services
+ * at the pace it picked. A write moves the connection to the active profile
+ * of its role; one esp_timer, always armed for the earliest idle deadline,
+ * moves connections that went quiet to the idle profile. The hot path (a
+ * write on a connection that is already active) is one lookup and one
+ * compare.
+ *
+ * Only one update procedure runs per connection. A change of mind while one
+ * is in flight is sent when it completes. A central that rejects a request
+ * is not asked again until the next active/idle transition.
+ */
+#include <stdbool.h>
+
+#include "host/ble_hs.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "conn_params.h"
+#include "conn_table.h"
+
+static const char *TAG = "conn_params";
+
+#define NO_DEADLINE INT64_MAX
+#define IDLE_US     ((int64_t)CONFIG_FAN_CONN_IDLE_MS * 1000)
+
+enum {
+    PROFILE_NONE,           /* whatever the central chose */
+    PROFILE_REMOTE_ACTIVE,
+    PROFILE_REMOTE_IDLE,
+    PROFILE_PHONE_ACTIVE,
+    PROFILE_PHONE_IDLE,
+    PROFILE_COUNT
+};
+
+typedef struct {
+    uint16_t itvl_ms;
+    uint16_t latency;
+} conn_profile_t;
+
+static conn_profile_t s_profiles[PROFILE_COUNT] = {
+    [PROFILE_REMOTE_ACTIVE] = { CONFIG_FAN_CONN_REMOTE_ACTIVE_ITVL_MS, 0 },
+    [PROFILE_REMOTE_IDLE]   = { CONFIG_FAN_CONN_REMOTE_IDLE_ITVL_MS, CONFIG_FAN_CONN_IDLE_LATENCY },
+    [PROFILE_PHONE_ACTIVE]  = { CONFIG_FAN_CONN_PHONE_ACTIVE_ITVL_MS, 0 },
+    [PROFILE_PHONE_IDLE]    = { CONFIG_FAN_CONN_PHONE_IDLE_ITVL_MS, CONFIG_FAN_CONN_IDLE_LATENCY },
+};
+
+static esp_timer_handle_t s_timer;
+static bool s_armed;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static inline bool is_idle(uint8_t profile)
+{
+    return profile == PROFILE_REMOTE_IDLE || profile == PROFILE_PHONE_IDLE;
+}
+
+/* A connection that never used the sequenced channel is treated as a phone */
+static inline uint8_t profile_for(const conn_ctx_t *c, bool idle)
+{
+    if (c->role == CONN_ROLE_REMOTE) {
+        return idle ? PROFILE_REMOTE_IDLE : PROFILE_REMOTE_ACTIVE;
+    }
+    return idle ? PROFILE_PHONE_IDLE : PROFILE_PHONE_ACTIVE;
+}
+
+#define SUPERVISION_MAX_MS 32000
+
+/* Requests span itvl_ms to 1.25 * itvl_ms; the central may pick either end */
+static inline uint32_t itvl_max_ms(const conn_profile_t *p)
+{
+    return p->itvl_ms + p->itvl_ms / 4;
+}
+
+/* The spec needs more than (1 + latency) * interval * 2; allow three missed
+ * windows and never less than 2 s. conn_params_init() keeps the latency low
+ * enough that the clamp to 32 s still leaves room above that minimum. */
+static uint16_t supervision_timeout(const conn_profile_t *p)
+{
+    uint32_t ms = (uint32_t)(1 + p->latency) * itvl_max_ms(p) * 3;
+
+    if (ms < 2000) {
+        ms = 2000;
+    } else if (ms > SUPERVISION_MAX_MS) {
+        ms = SUPERVISION_MAX_MS;
+    }
+    return BLE_GAP_SUPERVISION_TIMEOUT_MS(ms);
+}
+
+/* Ask for the profile the connection wants, unless an update is already
+ * running or that profile is what was asked for last */
+static void request(uint16_t conn_handle)
+{
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    uint8_t prev;
+    uint8_t want;
+    bool go;
+
+    if (c == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&s_mux);
+    prev = c->params_sent;
+    want = c->params_want;
+    go = !c->params_busy && want != prev && want != PROFILE_NONE;
+    if (go) {
+        c->params_busy = true;
+        c->params_sent = want;
+    }
+    portEXIT_CRITICAL(&s_mux);
+    if (!go) {
+        return;
+    }
+
+    const conn_profile_t *p = &s_profiles[want];
+    const struct ble_gap_upd_params up = {
+        .itvl_min = BLE_GAP_CONN_ITVL_MS(p->itvl_ms),
+        .itvl_max = BLE_GAP_CONN_ITVL_MS(itvl_max_ms(p)),
+        .latency = p->latency,
+        .supervision_timeout = supervision_timeout(p),
+    };
+    int rc = ble_gap_update_params(conn_handle, &up);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "conn %d: update to %u ms / latency %u failed; rc=%d",
+                 conn_handle, p->itvl_ms, p->latency, rc);
+        portENTER_CRITICAL(&s_mux);
+        c->params_busy = false;
+        c->params_sent = prev;
+        portEXIT_CRITICAL(&s_mux);
+    } else {
+        ESP_LOGD(TAG, "conn %d: requesting %u ms / latency %u",
+                 conn_handle, p->itvl_ms, p->latency);
+    }
+}
+
+/* Make sure the idle timer is running. A connection that just became active
+ * has the latest deadline of all, so a timer that is already armed fires no
+ * later than it needs to. */
+static void arm_idle(void)
+{
+    portENTER_CRITICAL(&s_mux);
+    bool arm = !s_armed;
+    s_armed = true;
+    portEXIT_CRITICAL(&s_mux);
+
+    if (arm) {
+        esp_timer_start_once(s_timer, IDLE_US);
+    }
+}
+
+static void idle_timer_cb(void *arg)
+{
+    uint16_t quiet[CONN_TABLE_MAX];
+    int64_t now = esp_timer_get_time();
+    int64_t next = NO_DEADLINE;
+    int n = 0;
+
+    portENTER_CRITICAL(&s_mux);
+    for (int i = 0; i < CONN_TABLE_MAX; i++) {
+        conn_ctx_t *c = conn_table_at(i);
+        if (c == NULL || is_idle(c->params_want)) {
+            continue;
+        }
+        int64_t at = c->last_activity_us + IDLE_US;
+        if (now >= at) {
+            c->params_want = profile_for(c, true);
+            quiet[n++] = c->conn_handle;
+        } else if (at < next) {
+            next = at;
+        }
+    }
+    s_armed = next != NO_DEADLINE;
+    portEXIT_CRITICAL(&s_mux);
+
+    for (int i = 0; i < n; i++) {
+        request(quiet[i]);
+    }
+    if (next != NO_DEADLINE) {
+        esp_timer_start_once(s_timer, (uint64_t)(next - now));
+    }
+}
+
+void conn_params_activity(uint16_t conn_handle)
+{
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    bool changed;
+
+    if (c == NULL) {
+        return;
+    }
+    uint8_t want = profile_for(c, false);
+
+    portENTER_CRITICAL(&s_mux);
+    changed = c->params_want != want;
+    c->params_want = want;
+    portEXIT_CRITICAL(&s_mux);
+
+    if (changed) {
+        arm_idle();
+        request(conn_handle);
+    }
+}
+
+void conn_params_on_connect(uint16_t conn_handle)
+{
+    struct ble_gap_conn_desc desc;
+    conn_ctx_t *c = conn_table_get(conn_handle);
+
+    if (c == NULL || ble_gap_conn_find(conn_handle, &desc) != 0) {
+        return;
+    }
+    portENTER_CRITICAL(&s_mux);
+    c->conn_itvl = desc.conn_itvl;
+    c->conn_latency = desc.conn_latency;
+    c->params_want = PROFILE_NONE;
+    c->params_sent = PROFILE_NONE;
+    c->params_busy = false;
+    portEXIT_CRITICAL(&s_mux);
+
+    arm_idle();
+}
+
+void conn_params_on_update(uint16_t conn_handle, int status)
+{
+    struct ble_gap_conn_desc desc;
+    conn_ctx_t *c = conn_table_get(conn_handle);
+
+    if (c == NULL || ble_gap_conn_find(conn_handle, &desc) != 0) {
+        return;
+    }
+    portENTER_CRITICAL(&s_mux);
+    c->conn_itvl = desc.conn_itvl;
+    c->conn_latency = desc.conn_latency;
+    c->params_busy = false;
+    portEXIT_CRITICAL(&s_mux);
+
+    if (status != 0) {
+        ESP_LOGW(TAG, "conn %d: parameter update rejected; status=%d",
+                 conn_handle, status);
+    }
+    /* send whatever the policy decided while the procedure ran */
+    request(conn_handle);
+}
+
+int conn_params_init(void)
+{
+    const esp_timer_create_args_t args = {
+        .callback = idle_timer_cb,
+        .name = "conn_params",
+    };
+
+    /* A long idle interval with a large latency has no valid supervision
+     * timeout; cut the latency down to the largest one that has */
+    for (int i = 0; i < PROFILE_COUNT; i++) {
+        conn_profile_t *p = &s_profiles[i];
+        uint32_t max_itvl = itvl_max_ms(p);
+
+        if (max_itvl == 0 ||
+            (uint32_t)(1 + p->latency) * max_itvl * 2 < SUPERVISION_MAX_MS) {
+            continue;
+        }
+        uint16_t latency = (SUPERVISION_MAX_MS - 1) / (max_itvl * 2) - 1;
+        ESP_LOGE(TAG, "%u ms interval allows latency %u at most, not %u; "
+                 "check CONFIG_FAN_CONN_IDLE_LATENCY",
+                 p->itvl_ms, latency, p->latency);
+        p->latency = latency;
+    }
+    return esp_timer_create(&args, &s_timer) == ESP_OK ? 0 : -1;
+}
@@ -0,0 +1,27 @@
+#pragma once
+/* conn_params.h
+ * Activity-adaptive connection parameters. A connection that is writing
+ * commands is asked for a short interval without peripheral latency; once
+ * it has been quiet for CONFIG_FAN_CONN_IDLE_MS it is asked for a long
+ * interval with latency. The remote and phones have separate profiles.
+ */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called by app_main once at startup */
+int conn_params_init(void);
+
+/* GAP hooks (main.c). The connection must be in conn_table. */
+void conn_params_on_connect(uint16_t conn_handle);
+void conn_params_on_update(uint16_t conn_handle, int status);
+
+/* A client wrote a characteristic; called after the write is handled so
+ * the connection's role is already known */
+void conn_params_activity(uint16_t conn_handle);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,94 @@
+/* fan_actuator.c
+ * Applies control state on its own task so the NimBLE host never waits on
+ * motor/LED driver work.
+ *
+ * The host side hands over the desired state through a triple buffer:
+ * the writer fills its private back buffer and swaps it into the shared
+ * middle slot, the reader swaps the middle slot with its front buffer.
+ * Both sides use one atomic exchange, nothing blocks, and whatever was
+ * posted last wins - intermediate values from a knob sweep are dropped.
+ */
+#include <stdatomic.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "fan_actuator.h"
+
+static const char *TAG = "fan_act";
+
+#define MB_IDX_MASK  0x03
+#define MB_FRESH     0x04    /* middle slot holds a state not yet taken */
+
+static fan_state_t s_buf[3];
+static atomic_uint_fast8_t s_mid = 1;   /* middle slot index | MB_FRESH */
+static uint8_t s_back = 0;              /* owned by the producer */
+static uint8_t s_front = 2;             /* owned by the actuator task */
+
+static TaskHandle_t s_task;
+static fan_actuator_applied_cb_t s_applied_cb;
+
+void fan_actuator_post(const fan_state_t *desired)
+{
+    s_buf[s_back] = *desired;
+    uint_fast8_t prev = atomic_exchange_explicit(&s_mid, s_back | MB_FRESH,
+                                                 memory_order_acq_rel);
+    s_back = prev & MB_IDX_MASK;
+}
+
+void fan_actuator_kick(void)
+{
+    if (s_task) {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+/* Take the newest state, if any was posted since the last take */
+static bool mailbox_take(fan_state_t *out)
+{
+    if (!(atomic_load_explicit(&s_mid, memory_order_acquire) & MB_FRESH)) {
+        return false;
+    }
+    uint_fast8_t prev = atomic_exchange_explicit(&s_mid, s_front,
+                                                 memory_order_acq_rel);
+    s_front = prev & MB_IDX_MASK;
+    *out = s_buf[s_front];
+    return true;
+}
+
+/* Drive the hardware. There is no motor/LED driver on this board yet, so
+ * this is the single hook where PWM / servo / LED calls belong. */
+static void actuator_drive(const fan_state_t *st)
+{
+    ESP_LOGD(TAG, "apply rpm=%u angle=%u light=%u power=%u",
+             (unsigned)st->rpm, (unsigned)st->angle, st->light, st->power);
+}
+
+static void fan_actuator_task(void *arg)
+{
+    fan_state_t st;
+
+    for (;;) {
+        /* sleep until something is posted */
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (mailbox_take(&st)) {
+            actuator_drive(&st);
+            if (s_applied_cb) {
+                s_applied_cb(&st);
+            }
+            /* pace the drivers; posts arriving meanwhile collapse into one */
+            vTaskDelay(pdMS_TO_TICKS(CONFIG_FAN_ACTUATOR_PERIOD_MS));
+        }
+    }
+}
+
+/* Called by app_main once at startup */
+void fan_actuator_init(fan_actuator_applied_cb_t applied_cb)
+{
+    s_applied_cb = applied_cb;
+    xTaskCreatePinnedToCore(fan_actuator_task, "fan_actuator", 3072, NULL, 6, &s_task, tskNO_AFFINITY);
+}
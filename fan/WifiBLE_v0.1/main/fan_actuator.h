@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Full desired (or applied) fan state */
+typedef struct fan_state {
+    uint32_t rpm;
+    uint32_t angle;
+    uint8_t  light;
+    uint8_t  power;
+} fan_state_t;
+
+/* Called from the actuator task after a state has been driven to hardware */
+typedef void (*fan_actuator_applied_cb_t)(const fan_state_t *applied);
+
+/* Create the mailbox and start the actuator task. Call from app_main(). */
+void fan_actuator_init(fan_actuator_applied_cb_t applied_cb);
+
+/* Publish the latest desired state. Never blocks and makes no FreeRTOS
+ * calls, so it may run inside a critical section; a state that has not
+ * been picked up yet is simply overwritten.
+ * Single producer: callers must serialise posts (gatt_svr.c posts under
+ * its state lock). */
+void fan_actuator_post(const fan_state_t *desired);
+
+/* Wake the actuator task after one or more posts. */
+void fan_actuator_kick(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,402 @@
+/* fan_cmd.c
+ * Decoder for the unified "packet" characteristic.
+ *
+ * The text format is a loose JSON-like list of "Key: value" pairs. Instead of
+ * flattening the mbuf and running strstr/sscanf once per key spelling, a small
+ * state machine is fed every byte of the os_mbuf chain exactly once and fills
+ * a fan_cmd_t as it goes.
+ *
+ * Compact clients (the remote) can send the binary TLV framing described in
+ * fan_cmd.h instead; both decode into the same fan_cmd_t.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "host/ble_hs.h"
+
+#include "fan_cmd.h"
+#include "mbuf_cursor.h"
+
+/* Longest key we know is 5 chars; anything longer is simply not a key. */
+#define TOK_KEY_MAX 6
+
+enum tok_state {
+    TOK_SEEK,   /* between tokens, waiting for a key */
+    TOK_KEY,    /* inside an alphabetic word */
+    TOK_SEP,    /* after a known key, skipping ":", spaces, braces... */
+    TOK_NUM,    /* inside a numeric value */
+    TOK_STR,    /* inside a string value */
+};
+
+enum tok_key {
+    KEY_NONE,
+    KEY_SPEED,
+    KEY_ANGLE,
+    KEY_LIGHT,
+    KEY_POWER,
+    KEY_SSID,
+    KEY_PASS,
+    KEY_WIFI,
+};
+
+static const struct {
+    char name[TOK_KEY_MAX];
+    uint8_t key;
+} tok_keys[] = {
+    { "speed", KEY_SPEED },
+    { "angle", KEY_ANGLE },
+    { "light", KEY_LIGHT },
+    { "power", KEY_POWER },
+    { "ssid",  KEY_SSID  },
+    { "pass",  KEY_PASS  },
+    { "wifi",  KEY_WIFI  },
+};
+
+struct fan_tok {
+    fan_cmd_t *cmd;
+    uint8_t state;
+    uint8_t key;
+    uint8_t key_len;
+    char key_buf[TOK_KEY_MAX];
+    bool sep_seen;      /* a real separator followed the key */
+    bool neg;
+    char quote;         /* 0 for unquoted strings */
+    uint32_t num;
+    char *str;          /* destination for TOK_STR */
+    uint8_t str_len;
+    uint8_t str_max;
+};
+
+static inline bool tok_is_alpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline bool tok_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline bool tok_is_sep(char c)
+{
+    return c == ' ' || c == ':' || c == ',' || c == '{' || c == '}' ||
+           c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline bool tok_is_quote(char c)
+{
+    return c == '"' || c == '\'';
+}
+
+static uint8_t tok_lookup_key(const struct fan_tok *t)
+{
+    if (t->key_len >= TOK_KEY_MAX) {
+        return KEY_NONE;
+    }
+    for (size_t i = 0; i < sizeof(tok_keys) / sizeof(tok_keys[0]); i++) {
+        if (strncmp(tok_keys[i].name, t->key_buf, t->key_len) == 0 &&
+            tok_keys[i].name[t->key_len] == '\0') {
+            return tok_keys[i].key;
+        }
+    }
+    return KEY_NONE;
+}
+
+static void tok_commit_num(struct fan_tok *t)
+{
+    fan_cmd_t *cmd = t->cmd;
+
+    if (t->neg) {
+        return;     /* negative values were never accepted */
+    }
+    switch (t->key) {
+    case KEY_SPEED: cmd->rpm   = t->num;          cmd->fields |= FAN_CMD_F_RPM;   break;
+    case KEY_ANGLE: cmd->angle = t->num;          cmd->fields |= FAN_CMD_F_ANGLE; break;
+    case KEY_LIGHT: cmd->light = (uint8_t)t->num; cmd->fields |= FAN_CMD_F_LIGHT; break;
+    case KEY_POWER: cmd->power = (uint8_t)t->num; cmd->fields |= FAN_CMD_F_POWER; break;
+    default: break;
+    }
+}
+
+static void tok_commit_str(struct fan_tok *t)
+{
+    /* trim trailing whitespace */
+    while (t->str_len > 0) {
+        char c = t->str[t->str_len - 1];
+        if (c != ' ' && c != '\r' && c != '\n' && c != '\t') break;
+        t->str_len--;
+    }
+    t->str[t->str_len] = '\0';
+    if (t->str_len == 0) {
+        return;
+    }
+    if (t->key == KEY_SSID) {
+        t->cmd->cred.ssid_len = t->str_len;
+        t->cmd->fields |= FAN_CMD_F_SSID;
+    } else {
+        t->cmd->cred.pass_len = t->str_len;
+        t->cmd->fields |= FAN_CMD_F_PASS;
+    }
+}
+
+static void tok_begin_value(struct fan_tok *t)
+{
+    t->state = TOK_SEP;
+    t->sep_seen = false;
+    t->neg = false;
+    t->num = 0;
+    t->quote = 0;
+    t->str_len = 0;
+    if (t->key == KEY_SSID) {
+        t->str = t->cmd->cred.ssid;
+        t->str_max = WIFI_SSID_MAX_LEN;
+    } else if (t->key == KEY_PASS) {
+        t->str = t->cmd->cred.pass;
+        t->str_max = WIFI_PASS_MAX_LEN;
+    }
+}
+
+static void tok_feed(struct fan_tok *t, char c)
+{
+    switch (t->state) {
+    case TOK_KEY:
+        if (tok_is_alpha(c)) {
+            if (t->key_len < TOK_KEY_MAX) {
+                t->key_buf[t->key_len] = (char)(c | 0x20);
+            }
+            if (t->key_len < UINT8_MAX) t->key_len++;
+            return;
+        }
+        t->key = tok_lookup_key(t);
+        if (t->key == KEY_WIFI) {
+            t->cmd->fields |= FAN_CMD_F_WIFI;
+            t->state = TOK_SEEK;
+        } else if (t->key != KEY_NONE) {
+            tok_begin_value(t);
+        } else {
+            t->state = TOK_SEEK;
+        }
+        break;  /* re-examine c in the new state */
+
+    case TOK_NUM:
+        if (tok_is_digit(c)) {
+            uint32_t d = (uint32_t)(c - '0');
+            t->num = (t->num > (UINT32_MAX - d) / 10) ? UINT32_MAX : t->num * 10 + d;
+            return;
+        }
+        tok_commit_num(t);
+        t->state = TOK_SEEK;
+        break;
+
+    case TOK_STR:
+        if (t->quote ? (c == t->quote) : (c == ',' || c == '}')) {
+            tok_commit_str(t);
+            t->state = TOK_SEEK;
+            return;
+        }
+        if (t->str_len < t->str_max) {
+            t->str[t->str_len++] = c;
+        }
+        return;
+
+    default:
+        break;
+    }
+
+    if (t->state == TOK_SEP) {
+        if (tok_is_sep(c)) {
+            t->sep_seen = true;
+            return;
+        }
+        if (tok_is_quote(c) && !t->sep_seen) {
+            return;     /* closing quote of a quoted key: "Speed": 10 */
+        }
+        if (t->key == KEY_SSID || t->key == KEY_PASS) {
+            t->state = TOK_STR;
+            if (tok_is_quote(c)) {
+                t->quote = c;
+            } else {
+                t->str[t->str_len++] = c;
+            }
+            return;
+        }
+        if (tok_is_quote(c) || c == '+') {
+            return;
+        }
+        if (c == '-') {
+            t->neg = true;
+            return;
+        }
+        if (tok_is_digit(c)) {
+            t->state = TOK_NUM;
+            t->num = (uint32_t)(c - '0');
+            return;
+        }
+        t->state = TOK_SEEK;
+    }
+
+    if (t->state == TOK_SEEK && tok_is_alpha(c)) {
+        t->state = TOK_KEY;
+        t->key_len = 0;
+        t->key_buf[t->key_len++] = (char)(c | 0x20);
+    }
+}
+
+static void tok_finish(struct fan_tok *t)
+{
+    switch (t->state) {
+    case TOK_KEY:
+        /* a trailing key can only be the bare "Wifi" marker */
+        if (tok_lookup_key(t) == KEY_WIFI) {
+            t->cmd->fields |= FAN_CMD_F_WIFI;
+        }
+        break;
+    case TOK_NUM:
+        tok_commit_num(t);
+        break;
+    case TOK_STR:
+        tok_commit_str(t);
+        break;
+    default:
+        break;
+    }
+}
+
+int fan_cmd_parse_text(const struct os_mbuf *om, fan_cmd_t *cmd)
+{
+    struct fan_tok t = { .cmd = cmd, .state = TOK_SEEK };
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->op = FAN_OP_SET;
+
+    for (const struct os_mbuf *m = om; m != NULL; m = SLIST_NEXT(m, om_next)) {
+        for (uint16_t i = 0; i < m->om_len; i++) {
+            tok_feed(&t, (char)m->om_data[i]);
+        }
+    }
+    tok_finish(&t);
+    return 0;
+}
+
+/* ---------- Binary TLV framing ---------- */
+
+int fan_cmd_parse_bin(const struct os_mbuf *om, fan_cmd_t *cmd)
+{
+    mbuf_cursor_t c;
+    uint8_t hdr;
+    uint32_t v;
+
+    memset(cmd, 0, sizeof(*cmd));
+    mbuf_cursor_init(&c, om);
+
+    if (mbuf_cursor_u8(&c, &hdr) != 0 ||
+        FAN_PKT_HDR_VER(hdr) != FAN_PKT_VERSION) {
+        return BLE_ATT_ERR_INVALID_PDU;
+    }
+    cmd->op = FAN_PKT_HDR_OP(hdr);
+    if (cmd->op == FAN_OP_SEQ_SET) {
+        if (mbuf_cursor_le(&c, 2, &v) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        cmd->seq = (uint16_t)v;
+    } else if (cmd->op != FAN_OP_SET) {
+        return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+
+    while (mbuf_cursor_left(&c) > 0) {
+        uint8_t tag;
+        uint8_t len;
+
+        mbuf_cursor_u8(&c, &tag);
+        len = tag & 0x0F;
+        if (len == FAN_TLV_LEN_EXT) {
+            if (mbuf_cursor_u8(&c, &len) != 0) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+        }
+        if (len > mbuf_cursor_left(&c)) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+
+        switch (tag >> 4) {
+        case FAN_TLV_RPM:
+        case FAN_TLV_ANGLE:
+            if (mbuf_cursor_le(&c, len, &v) != 0) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            if ((tag >> 4) == FAN_TLV_RPM) {
+                cmd->rpm = v;
+                cmd->fields |= FAN_CMD_F_RPM;
+            } else {
+                cmd->angle = v;
+                cmd->fields |= FAN_CMD_F_ANGLE;
+            }
+            break;
+
+        case FAN_TLV_LIGHT:
+        case FAN_TLV_POWER:
+            if (len != sizeof(uint8_t)) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            if ((tag >> 4) == FAN_TLV_LIGHT) {
+                mbuf_cursor_u8(&c, &cmd->light);
+                cmd->fields |= FAN_CMD_F_LIGHT;
+            } else {
+                mbuf_cursor_u8(&c, &cmd->power);
+                cmd->fields |= FAN_CMD_F_POWER;
+            }
+            break;
+
+        case FAN_TLV_CLOCK:
+            if (len != sizeof(uint16_t)) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            mbuf_cursor_le(&c, len, &v);
+            cmd->clock = (uint16_t)v;
+            cmd->fields |= FAN_CMD_F_CLOCK;
+            break;
+
+        case FAN_TLV_SSID:
+            if (len < 1 || len > WIFI_SSID_MAX_LEN) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            mbuf_cursor_read(&c, cmd->cred.ssid, len);
+            cmd->cred.ssid[len] = '\0';
+            cmd->cred.ssid_len = len;
+            cmd->fields |= FAN_CMD_F_SSID;
+            break;
+
+        case FAN_TLV_PASS:
+            if (len > WIFI_PASS_MAX_LEN) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            mbuf_cursor_read(&c, cmd->cred.pass, len);
+            cmd->cred.pass[len] = '\0';
+            cmd->cred.pass_len = len;
+            cmd->fields |= FAN_CMD_F_PASS;
+            break;
+
+        default:
+            /* unknown type: skip it */
+            mbuf_cursor_skip(&c, len);
+            break;
+        }
+    }
+    return 0;
+}
+
+int fan_cmd_parse(const struct os_mbuf *om, fan_cmd_t *cmd)
+{
+    mbuf_cursor_t c;
+    uint8_t first;
+
+    mbuf_cursor_init(&c, om);
+    if (mbuf_cursor_u8(&c, &first) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    if (first & FAN_PKT_BIN_FLAG) {
+        return fan_cmd_parse_bin(om, cmd);
+    }
+    return fan_cmd_parse_text(om, cmd);
+}
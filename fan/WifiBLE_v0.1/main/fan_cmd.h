@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include "wifi_cred.h"   // contains wifi_credentials_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct os_mbuf;
+
+/* Bits in fan_cmd_t.fields: which keys were present in the packet */
+#define FAN_CMD_F_RPM    (1u << 0)
+#define FAN_CMD_F_ANGLE  (1u << 1)
+#define FAN_CMD_F_LIGHT  (1u << 2)
+#define FAN_CMD_F_POWER  (1u << 3)
+#define FAN_CMD_F_SSID   (1u << 4)
+#define FAN_CMD_F_PASS   (1u << 5)
+#define FAN_CMD_F_WIFI   (1u << 6)   /* bare "Wifi" marker, no value */
+#define FAN_CMD_F_CLOCK  (1u << 7)   /* writer's Lamport time for this write */
+
+/* Binary framing. The first byte of a binary packet has bit 7 set (never
+ * valid in the text format) and carries a 3-bit version and a 4-bit opcode:
+ *
+ *     [1 vvv oooo] [tag][value]...
+ *
+ * Each field tag is (type << 4) | len. A len nibble of 0xF means the real
+ * length follows in the next byte (used for credentials).
+ * e.g. Speed 1200, Angle 45, Light 1, Power 1 -> 91 12 b0 04 21 2d 31 01 41 01
+ */
+#define FAN_PKT_BIN_FLAG     0x80
+#define FAN_PKT_VERSION      1
+#define FAN_PKT_HDR(op)      (FAN_PKT_BIN_FLAG | (FAN_PKT_VERSION << 4) | (op))
+#define FAN_PKT_HDR_VER(b)   (((b) >> 4) & 0x07)
+#define FAN_PKT_HDR_OP(b)    ((b) & 0x0F)
+
+/* Opcodes */
+#define FAN_OP_SET           0x1     /* apply the fields that follow */
+#define FAN_OP_SEQ_SET       0x2     /* seq(2, le) then fields, as FAN_OP_SET */
+
+/* Field types */
+#define FAN_TLV_RPM          0x1     /* uint, 1..4 bytes little-endian */
+#define FAN_TLV_ANGLE        0x2     /* uint, 1..4 bytes little-endian */
+#define FAN_TLV_LIGHT        0x3     /* uint8 */
+#define FAN_TLV_POWER        0x4     /* uint8 */
+#define FAN_TLV_SSID         0x5     /* 1..32 bytes, not nul-terminated */
+#define FAN_TLV_PASS         0x6     /* 0..64 bytes, not nul-terminated */
+#define FAN_TLV_CLOCK        0x7     /* uint16: writer's Lamport time */
+#define FAN_TLV_LEN_EXT      0xF
+
+#define FAN_CMD_F_CTRL   (FAN_CMD_F_RPM | FAN_CMD_F_ANGLE | FAN_CMD_F_LIGHT | FAN_CMD_F_POWER)
+#define FAN_CMD_F_PROV   (FAN_CMD_F_SSID | FAN_CMD_F_WIFI)
+
+/* Decoded packet. Only the members flagged in `fields` are valid. */
+typedef struct {
+    uint8_t  op;        /* FAN_OP_*; text packets are always FAN_OP_SET */
+    uint16_t seq;       /* FAN_OP_SEQ_SET only */
+    uint32_t fields;
+    uint32_t rpm;
+    uint32_t angle;
+    uint8_t  light;
+    uint8_t  power;
+    uint16_t clock;
+    wifi_credentials_t cred;
+} fan_cmd_t;
+
+/* Tokenize a text packet such as "{Speed: 1200, Angle: 45}" or
+ * "{Wifi, SSID: 'home', PASS: 'secret'}" straight out of the mbuf chain.
+ * Keys are matched case-insensitively; negative numbers are ignored.
+ * Returns 0 on success (even if no key was recognised). */
+int fan_cmd_parse_text(const struct os_mbuf *om, fan_cmd_t *cmd);
+
+/* Decode a binary packet (see FAN_PKT_HDR). Unknown field types are skipped
+ * so newer clients can talk to older fans.
+ * Returns 0 on success or a BLE_ATT_ERR_* code for a malformed packet. */
+int fan_cmd_parse_bin(const struct os_mbuf *om, fan_cmd_t *cmd);
+
+/* Detect text vs binary from the first byte and decode accordingly.
+ * Returns 0 on success or a BLE_ATT_ERR_* code. */
+int fan_cmd_parse(const struct os_mbuf *om, fan_cmd_t *cmd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,317 @@
+/* fan_profile.c
+ * Ramps, angle sweeps and step sequences run on the fan itself.
+ *
+ * A profile is a trajectory over time. Every CONFIG_FAN_PROFILE_TICK_MS an
+ * esp_timer evaluates it at the current time in Q16.16 fixed point and
+ * hands the point to the output callback (gatt_svr.c, which commits it as
+ * a control transaction). Positions are computed from elapsed time, not
+ * from tick counts, so a late tick never accumulates drift.
+ *
+ * Each tick evaluates and outputs holding s_out_lock, and fan_profile_stop()
+ * takes the same lock after clearing s_fields. So when stop returns, no
+ * point of the old profile can still land on top of whatever the caller
+ * writes next. The tick runs in the shared esp_timer task and must not
+ * block there: if stop holds the lock the tick is skipped, and having
+ * changed nothing it leaves the next one to pick up from the clock.
+ */
+#include <string.h>
+
+#include "host/ble_hs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "fan_cmd.h"
+#include "fan_profile.h"
+#include "mbuf_cursor.h"
+
+static const char *TAG = "fan_profile";
+
+#define Q16_ONE     (1u << 16)
+
+static fan_profile_t s_prof;
+static uint32_t s_fields;           /* fields being driven, 0 = idle */
+static int64_t  s_t0;               /* start of the current segment (us) */
+static uint8_t  s_step;             /* sequence: current step */
+static uint32_t s_from_rpm;         /* segment start points */
+static uint32_t s_from_angle;
+
+static esp_timer_handle_t s_timer;
+static fan_profile_output_cb_t s_output;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t s_out_lock;    /* held around each tick */
+
+/* ---------- fixed point ---------- */
+
+/* Progress of t through [0, dur] as Q16.16 in 0..Q16_ONE */
+static inline uint32_t q16_frac(int64_t t_us, int64_t dur_us)
+{
+    if (dur_us <= 0 || t_us >= dur_us) return Q16_ONE;
+    if (t_us <= 0) return 0;
+    return (uint32_t)((t_us << 16) / dur_us);
+}
+
+static inline uint32_t q16_lerp(uint32_t a, uint32_t b, uint32_t f)
+{
+    return (uint32_t)((int64_t)a + ((((int64_t)b - (int64_t)a) * f) >> 16));
+}
+
+/* ---------- evaluation (under s_mux) ---------- */
+
+/* Fill rpm/angle for time `now`. Returns true when the profile is over;
+ * the point returned is then its final position. */
+static bool profile_eval(int64_t now, uint32_t *rpm, uint32_t *angle)
+{
+    int64_t el = now - s_t0;
+
+    switch (s_prof.kind) {
+    case FAN_PROFILE_RAMP: {
+        uint32_t f = q16_frac(el, (int64_t)s_prof.ramp.duration_ms * 1000);
+        if (s_prof.ramp.field == FAN_CMD_F_RPM) {
+            *rpm = q16_lerp(s_from_rpm, s_prof.ramp.target, f);
+        } else {
+            *angle = q16_lerp(s_from_angle, s_prof.ramp.target, f);
+        }
+        return f == Q16_ONE;
+    }
+
+    case FAN_PROFILE_SWEEP: {
+        int64_t period = (int64_t)s_prof.sweep.period_ms * 1000;
+        if (s_prof.sweep.cycles && el >= period * s_prof.sweep.cycles) {
+            *angle = s_prof.sweep.min;
+            return true;
+        }
+        /* triangle wave: min -> max over the first half, back over the second */
+        int64_t phase = el % period;
+        int64_t half = period / 2;
+        uint32_t f = phase < half ? q16_frac(phase, half) : q16_frac(period - phase, half);
+        *angle = q16_lerp(s_prof.sweep.min, s_prof.sweep.max, f);
+        return false;
+    }
+
+    case FAN_PROFILE_SEQ:
+        for (;;) {
+            const fan_profile_step_t *st = &s_prof.seq.steps[s_step];
+            int64_t ramp = (int64_t)st->ramp_ms * 1000;
+            int64_t hold = (int64_t)st->hold_ms * 1000;
+
+            if (el < ramp + hold) {
+                uint32_t f = q16_frac(el, ramp);
+                *rpm = q16_lerp(s_from_rpm, st->rpm, f);
+                *angle = q16_lerp(s_from_angle, st->angle, f);
+                return false;
+            }
+            /* step finished: the next one starts from its targets */
+            s_from_rpm = st->rpm;
+            s_from_angle = st->angle;
+            s_t0 += ramp + hold;
+            el -= ramp + hold;
+            if (++s_step == s_prof.seq.n) {
+                if (!s_prof.seq.loop) {
+                    *rpm = st->rpm;
+                    *angle = st->angle;
+                    return true;
+                }
+                s_step = 0;
+            }
+        }
+
+    default:
+        return true;
+    }
+}
+
+static void profile_tick(void *arg)
+{
+    uint32_t fields;
+    uint32_t rpm = 0, angle = 0;
+    bool done = false;
+
+    if (xSemaphoreTake(s_out_lock, 0) != pdTRUE) {
+        return;
+    }
+
+    portENTER_CRITICAL(&s_mux);
+    fields = s_fields;
+    if (fields) {
+        done = profile_eval(esp_timer_get_time(), &rpm, &angle);
+    }
+    portEXIT_CRITICAL(&s_mux);
+
+    if (fields) {
+        s_output(fields, rpm, angle);
+        if (done) {
+            /* s_fields stays set until the last point is out, so a cancel
+             * in the meantime still waits for it */
+            portENTER_CRITICAL(&s_mux);
+            s_fields = 0;
+            portEXIT_CRITICAL(&s_mux);
+            esp_timer_stop(s_timer);
+            ESP_LOGI(TAG, "profile finished");
+        }
+    }
+    xSemaphoreGive(s_out_lock);
+}
+
+/* ---------- control ---------- */
+
+void fan_profile_stop(void)
+{
+    portENTER_CRITICAL(&s_mux);
+    uint32_t was = s_fields;
+    s_fields = 0;
+    portEXIT_CRITICAL(&s_mux);
+
+    /* wait out a tick that is outputting; later ones see no fields */
+    xSemaphoreTake(s_out_lock, portMAX_DELAY);
+    esp_timer_stop(s_timer);    /* may already be idle */
+    xSemaphoreGive(s_out_lock);
+
+    if (was) {
+        ESP_LOGI(TAG, "profile stopped");
+    }
+}
+
+void fan_profile_cancel(uint32_t fields)
+{
+    portENTER_CRITICAL(&s_mux);
+    bool hit = (s_fields & fields) != 0;
+    portEXIT_CRITICAL(&s_mux);
+
+    if (hit) {
+        fan_profile_stop();
+    }
+}
+
+void fan_profile_start(const fan_profile_t *p, const fan_state_t *from)
+{
+    uint32_t fields;
+    esp_err_t err;
+
+    fan_profile_stop();
+    switch (p->kind) {
+    case FAN_PROFILE_RAMP:  fields = p->ramp.field; break;
+    case FAN_PROFILE_SWEEP: fields = FAN_CMD_F_ANGLE; break;
+    case FAN_PROFILE_SEQ:   fields = FAN_CMD_F_RPM | FAN_CMD_F_ANGLE; break;
+    default:                return;
+    }
+
+    portENTER_CRITICAL(&s_mux);
+    s_prof = *p;
+    s_from_rpm = from->rpm;
+    s_from_angle = from->angle;
+    s_step = 0;
+    s_t0 = esp_timer_get_time();
+    s_fields = fields;
+    portEXIT_CRITICAL(&s_mux);
+
+    err = esp_timer_start_periodic(s_timer, (uint64_t)CONFIG_FAN_PROFILE_TICK_MS * 1000);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "profile timer start failed: %s", esp_err_to_name(err));
+        portENTER_CRITICAL(&s_mux);
+        s_fields = 0;
+        portEXIT_CRITICAL(&s_mux);
+        return;
+    }
+    ESP_LOGI(TAG, "profile %u started", p->kind);
+}
+
+/* ---------- decoding ---------- */
+
+int fan_profile_parse(const struct os_mbuf *om, fan_profile_t *out)
+{
+    mbuf_cursor_t c;
+    uint32_t v;
+    uint8_t b;
+
+    memset(out, 0, sizeof(*out));
+    mbuf_cursor_init(&c, om);
+    if (mbuf_cursor_u8(&c, &out->kind) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    switch (out->kind) {
+    case FAN_PROFILE_STOP:
+        break;
+
+    case FAN_PROFILE_RAMP:
+        if (mbuf_cursor_u8(&c, &b) != 0 ||
+            mbuf_cursor_le(&c, 4, &out->ramp.target) != 0 ||
+            mbuf_cursor_le(&c, 4, &out->ramp.duration_ms) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        if (b > 1) {
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+        }
+        out->ramp.field = b == 0 ? FAN_CMD_F_RPM : FAN_CMD_F_ANGLE;
+        break;
+
+    case FAN_PROFILE_SWEEP:
+        if (mbuf_cursor_le(&c, 4, &out->sweep.min) != 0 ||
+            mbuf_cursor_le(&c, 4, &out->sweep.max) != 0 ||
+            mbuf_cursor_le(&c, 4, &out->sweep.period_ms) != 0 ||
+            mbuf_cursor_le(&c, 2, &v) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        out->sweep.cycles = (uint16_t)v;
+        if (out->sweep.period_ms < 2 * CONFIG_FAN_PROFILE_TICK_MS) {
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+        }
+        break;
+
+    case FAN_PROFILE_SEQ: {
+        uint32_t total_ms = 0;
+        if (mbuf_cursor_u8(&c, &b) != 0 || mbuf_cursor_u8(&c, &out->seq.n) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        out->seq.loop = b & 1;
+        if (out->seq.n == 0 || out->seq.n > FAN_PROFILE_MAX_STEPS) {
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+        }
+        for (uint8_t i = 0; i < out->seq.n; i++) {
+            fan_profile_step_t *st = &out->seq.steps[i];
+            if (mbuf_cursor_le(&c, 4, &st->rpm) != 0 ||
+                mbuf_cursor_le(&c, 4, &st->angle) != 0 ||
+                mbuf_cursor_le(&c, 2, &v) != 0) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            st->ramp_ms = (uint16_t)v;
+            if (mbuf_cursor_le(&c, 2, &v) != 0) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            st->hold_ms = (uint16_t)v;
+            total_ms += st->ramp_ms + st->hold_ms;
+        }
+        /* a looping sequence must take time, or evaluation would spin */
+        if (out->seq.loop && total_ms == 0) {
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+        }
+        break;
+    }
+
+    default:
+        return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+
+    if (mbuf_cursor_left(&c) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    return 0;
+}
+
+int fan_profile_init(fan_profile_output_cb_t output)
+{
+    s_output = output;
+    s_out_lock = xSemaphoreCreateMutex();
+    if (s_out_lock == NULL) {
+        return -1;
+    }
+
+    const esp_timer_create_args_t args = {
+        .callback = profile_tick,
+        .name = "fan_profile",
+    };
+    return esp_timer_create(&args, &s_timer) == ESP_OK ? 0 : -1;
+}
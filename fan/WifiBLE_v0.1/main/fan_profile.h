@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "fan_actuator.h"   // contains fan_state_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct os_mbuf;
+
+#define FAN_PROFILE_MAX_STEPS   8
+
+/* Profile characteristic commands (first byte), all integers little-endian:
+ *
+ *     00                                          stop
+ *     01 field target(4) duration_ms(4)           ramp rpm (field 0) or angle (1)
+ *     02 min(4) max(4) period_ms(4) cycles(2)     sweep angle, cycles 0 = forever
+ *     03 loop n {rpm(4) angle(4) ramp_ms(2) hold_ms(2)} x n
+ *                                                 sequence of up to 8 steps
+ */
+#define FAN_PROFILE_STOP        0x00
+#define FAN_PROFILE_RAMP        0x01
+#define FAN_PROFILE_SWEEP       0x02
+#define FAN_PROFILE_SEQ         0x03
+
+typedef struct {
+    uint32_t rpm;
+    uint32_t angle;
+    uint16_t ramp_ms;       /* time to move from the previous step */
+    uint16_t hold_ms;       /* time to stay before the next step */
+} fan_profile_step_t;
+
+typedef struct {
+    uint8_t kind;           /* FAN_PROFILE_* */
+    union {
+        struct {
+            uint32_t field;         /* FAN_CMD_F_RPM or FAN_CMD_F_ANGLE */
+            uint32_t target;
+            uint32_t duration_ms;
+        } ramp;
+        struct {
+            uint32_t min;
+            uint32_t max;
+            uint32_t period_ms;     /* full min -> max -> min cycle */
+            uint16_t cycles;
+        } sweep;
+        struct {
+            bool     loop;
+            uint8_t  n;
+            fan_profile_step_t steps[FAN_PROFILE_MAX_STEPS];
+        } seq;
+    };
+} fan_profile_t;
+
+/* Receives each new trajectory point; `fields` says which of rpm/angle
+ * are driven. Runs on the esp_timer task. */
+typedef void (*fan_profile_output_cb_t)(uint32_t fields, uint32_t rpm, uint32_t angle);
+
+/* Create the profile timer. Call once before the GATT server starts. */
+int fan_profile_init(fan_profile_output_cb_t output);
+
+/* Decode a profile command. Returns 0 or a BLE_ATT_ERR_* code. */
+int fan_profile_parse(const struct os_mbuf *om, fan_profile_t *out);
+
+/* Start `p` from the current control state (`from` gives the ramp start
+ * points); replaces any running profile. STOP just stops. Once stop
+ * returns, no point of the old profile is output any more. Not callable
+ * from the output callback. */
+void fan_profile_start(const fan_profile_t *p, const fan_state_t *from);
+void fan_profile_stop(void);
+
+/* A client wrote some of `fields` directly: stop the profile if it drives
+ * any of them, so manual control always wins. */
+void fan_profile_cancel(uint32_t fields);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Aggregate status record, exposed as one read/notify characteristic in the
+ * status service so a client can sync the whole fan state in a single ATT
+ * round trip. Little-endian, packed; new fields are only ever appended and
+ * bump FAN_STATUS_VERSION, so clients must accept a longer value.
+ *
+ *     ver flags power light rpm(4) angle(4) seq(2) ack(2) clock(2)   -> 18 bytes
+ *
+ * `ack` is per connection: the last FAN_OP_SEQ_SET sequence number the fan
+ * applied from the client receiving the record (valid if FAN_STATUS_F_ACK).
+ * `clock` is the control clock (largest write timestamp applied); clients
+ * move their own clock past it and stamp writes with FAN_TLV_CLOCK.
+ */
+#define FAN_STATUS_VERSION   3
+
+#define FAN_STATUS_F_ACK     (1u << 0)   /* ack holds a sequence number */
+
+typedef struct __attribute__((packed)) {
+    uint8_t  version;   /* FAN_STATUS_VERSION */
+    uint8_t  flags;     /* FAN_STATUS_F_* */
+    uint8_t  power;
+    uint8_t  light;
+    uint32_t rpm;
+    uint32_t angle;
+    uint16_t seq;       /* incremented whenever any field changes */
+    uint16_t ack;       /* since version 2 */
+    uint16_t clock;     /* since version 3 */
+} fan_status_t;
+
+_Static_assert(sizeof(fan_status_t) == 18, "fan_status_t is a wire format");
+
+#ifdef __cplusplus
+}
+#endif
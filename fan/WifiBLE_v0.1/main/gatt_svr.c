@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 
 #include "host/ble_hs.h"
 #include "host/ble_uuid.h"
@@ -25,103 +26,452 @@
 
 /* wifi_cred.h defines wifi_credentials_t */
 #include "wifi_cred.h"
+#include "fan_cmd.h"
+#include "fan_status.h"
+#include "fan_actuator.h"
+#include "status_notify.h"
+#include "mbuf_cursor.h"
+#include "preset_store.h"
+#include "fan_profile.h"
+#include "conn_table.h"
+#include "conn_params.h"
+#include "fan_adv.h"
 
 //extern QueueHandle_t wifi_cred_queue;
 
 
 static const char *TAG = "gatt_svr";
 
-/*** Maximum number of characteristics with the notify flag ***/
-#define MAX_CONNECTIONS 2
-
-/* existing control/status handles (unchanged) */
-static uint16_t ctrl_rpm_handle;
-static uint16_t ctrl_angle_handle;
-static uint16_t ctrl_light_handle;
-static uint16_t ctrl_power_handle;
-
-static uint16_t stat_rpm_handle;
-static uint16_t stat_angle_handle;
-static uint16_t stat_light_handle;
-static uint16_t stat_power_handle;
-
-/* NEW: packet characteristic handle */
-static uint16_t packet_handle;
-
-/* connection handle tracking (your previous code) */
-static uint16_t conn_handles[MAX_CONNECTIONS] = {BLE_HS_CONN_HANDLE_NONE, BLE_HS_CONN_HANDLE_NONE};
-int add_connection_handle(uint16_t conn_handle) {
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (conn_handles[i] == BLE_HS_CONN_HANDLE_NONE) {
-            conn_handles[i] = conn_handle;
-            return i;
-        }
-    }
-    return -1;
+/* ---------- Characteristic table ----------
+ * Every control/status characteristic is declared once here. The lists
+ * below generate the handle variables, the value storage (g_<name>), the
+ * UUIDs, the descriptor table used for dispatch and the ble_gatt_chr_def
+ * arrays, so adding a characteristic is a one-line change.
+ *
+ * V(name, uuid0, uuid1, type, field, flags, write_fn)
+ *     plain value characteristic backed by `static type g_<name>`; the two
+ *     uuid bytes select 98badcfe-efcd-ab90-dead-beef<uuid1><uuid0>
+ * C(name, flags, read_fn, write_fn)
+ *     custom characteristic with no storage; `<name>_uuid` is declared by hand
+ *
+ * Order inside a list is the attribute order inside the service.
+ */
+#define CHR_F_CTRL  (BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE)
+#define CHR_F_STAT  (BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY)
+
+#define CONTROL_CHRS(V, C) \
+    V(ctrl_rpm,   0x01, 0xC7, uint32_t, FAN_CMD_F_RPM,   CHR_F_CTRL, chr_write_ctrl) \
+    V(ctrl_angle, 0x02, 0xC7, uint32_t, FAN_CMD_F_ANGLE, CHR_F_CTRL, chr_write_ctrl) \
+    V(ctrl_light, 0x03, 0xC7, uint8_t,  FAN_CMD_F_LIGHT, CHR_F_CTRL, chr_write_ctrl) \
+    V(ctrl_power, 0x04, 0xC7, uint8_t,  FAN_CMD_F_POWER, CHR_F_CTRL, chr_write_ctrl) \
+    C(packet, BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP, NULL, chr_write_packet) \
+    C(preset, BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP, \
+      chr_read_preset, chr_write_preset) \
+    C(profile, BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP, NULL, chr_write_profile)
+
+#define STATUS_CHRS(V, C) \
+    V(stat_rpm,   0x01, 0x57, uint32_t, FAN_CMD_F_RPM,   CHR_F_STAT, NULL) \
+    V(stat_angle, 0x02, 0x57, uint32_t, FAN_CMD_F_ANGLE, CHR_F_STAT, NULL) \
+    V(stat_light, 0x03, 0x57, uint8_t,  FAN_CMD_F_LIGHT, CHR_F_STAT, NULL) \
+    V(stat_power, 0x04, 0x57, uint8_t,  FAN_CMD_F_POWER, CHR_F_STAT, NULL) \
+    C(stat_all, CHR_F_STAT, chr_read_stat_all, NULL)
+
+#define ALL_CHRS(V, C)  CONTROL_CHRS(V, C) STATUS_CHRS(V, C)
+
+/* generators */
+#define CHR_GEN_NONE(...)
+#define CHR_GEN_HANDLE(name, ...)       static uint16_t name##_handle;
+#define CHR_GEN_STORE_V(name, u0, u1, type, ...)  static type g_##name;
+#define CHR_GEN_UUID_V(name, u0, u1, ...) \
+    static const ble_uuid128_t name##_uuid = BLE_UUID128_INIT( \
+        u0,u1,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
+#define CHR_GEN_ENUM(name, ...)         CHR_##name,
+
+/* handles (filled in by ble_gatts_add_svcs) and value storage */
+ALL_CHRS(CHR_GEN_HANDLE, CHR_GEN_HANDLE)
+ALL_CHRS(CHR_GEN_STORE_V, CHR_GEN_NONE)
+
+enum { ALL_CHRS(CHR_GEN_ENUM, CHR_GEN_ENUM) CHR_COUNT };
+
+static uint16_t g_stat_seq = 0;      /* bumped on every status change */
+
+/* ---------- Control transactions ----------
+ * A packet may set several fields at once. They are staged in a ctrl_txn_t
+ * and applied together by ctrl_txn_commit(): g_ctrl_* change inside one
+ * critical section and the resulting desired state is posted to the
+ * actuator task. The actuator reports back through
+ * gatt_svr_status_applied(), which updates g_stat_* in one go and publishes
+ * the status once per applied state.
+ */
+typedef struct {
+    uint32_t fields;    /* FAN_CMD_F_* bits staged so far */
+    uint32_t rpm;
+    uint32_t angle;
+    uint8_t  light;
+    uint8_t  power;
+    bool     has_clock; /* the writer sent its Lamport time */
+    uint16_t clock;
+    uint32_t rejected;  /* fields dropped by ctrl_txn_merge() */
+} ctrl_txn_t;
+
+static portMUX_TYPE s_state_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* ---------- Multi-writer merge ----------
+ * Several clients write the same g_ctrl_* fields, and a retried or delayed
+ * write must not undo a newer one. Every client write carries a Lamport
+ * timestamp (clock, writer): clients keep a clock that moves past every
+ * status `clock` they see and ticks once per write they send; writes that
+ * carry no clock get the fan's clock + 1. The writer is the connection
+ * handle and breaks ties. Each field keeps the stamp of its last write and
+ * only a strictly newer stamp replaces it (last writer wins), so the result
+ * does not depend on arrival order and a retransmit of an applied write is
+ * a no-op. The fan's clock follows the largest stamp applied; it is 32 bits
+ * here and 16 on the wire, where a client value is taken as the nearest
+ * one to the current clock.
+ */
+typedef struct {
+    uint32_t clock;
+    uint16_t writer;
+} ctrl_stamp_t;
+
+static uint32_t g_ctrl_clock;
+static ctrl_stamp_t s_ctrl_stamp[4];    /* by FAN_CMD_F_* bit position */
+
+static inline void ctrl_txn_begin(ctrl_txn_t *txn)
+{
+    memset(txn, 0, sizeof(*txn));
+}
+static inline void ctrl_txn_set_rpm(ctrl_txn_t *txn, uint32_t rpm)
+{
+    txn->rpm = rpm;
+    txn->fields |= FAN_CMD_F_RPM;
 }
-void remove_connection_handle(uint16_t conn_handle) {
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (conn_handles[i] == conn_handle) {
-            conn_handles[i] = BLE_HS_CONN_HANDLE_NONE;
+static inline void ctrl_txn_set_angle(ctrl_txn_t *txn, uint32_t angle)
+{
+    txn->angle = angle;
+    txn->fields |= FAN_CMD_F_ANGLE;
+}
+static inline void ctrl_txn_set_light(ctrl_txn_t *txn, uint8_t light)
+{
+    txn->light = light;
+    txn->fields |= FAN_CMD_F_LIGHT;
+}
+static inline void ctrl_txn_set_power(ctrl_txn_t *txn, uint8_t power)
+{
+    txn->power = power;
+    txn->fields |= FAN_CMD_F_POWER;
+}
+static inline void ctrl_txn_set_clock(ctrl_txn_t *txn, uint16_t clock)
+{
+    txn->clock = clock;
+    txn->has_clock = true;
+}
+
+/* Under s_state_mux: keep only the staged fields this write wins */
+static void ctrl_txn_merge(ctrl_txn_t *txn, uint16_t writer)
+{
+    uint32_t kept = 0;
+    uint32_t w = g_ctrl_clock + 1;
+
+    if (txn->has_clock) {
+        w = g_ctrl_clock + (int16_t)(txn->clock - (uint16_t)g_ctrl_clock);
+    }
+    for (int i = 0; i < 4; i++) {
+        uint32_t f = 1u << i;
+        ctrl_stamp_t *st = &s_ctrl_stamp[i];
+        if (!(txn->fields & f)) {
+            continue;
         }
+        if ((int32_t)(w - st->clock) > 0 ||
+            (w == st->clock && writer > st->writer)) {
+            st->clock = w;
+            st->writer = writer;
+            kept |= f;
+        }
+    }
+    txn->rejected = txn->fields & ~kept;
+    txn->fields = kept;
+    if (kept && (int32_t)(w - g_ctrl_clock) > 0) {
+        g_ctrl_clock = w;
     }
 }
-int count_active_connections(void) {
-    int count = 0;
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (conn_handles[i] != BLE_HS_CONN_HANDLE_NONE) count++;
+
+/* ---------- Sequenced control channel ----------
+ * FAN_OP_SEQ_SET packets are meant to be sent with write-without-response,
+ * so a client can put several of them in one connection event. Each
+ * connection keeps a cumulative ack, the last sequence number applied in
+ * order, and gets it back in the aggregate status record:
+ *   - the next number is applied and becomes the ack;
+ *   - a number at or below the ack is a retransmit and is only re-acked;
+ *   - a number past the next one means a packet was lost, so it is dropped
+ *     and the client resends from the gap (go-back-N).
+ * The first packet on a connection sets the starting point. The channel
+ * state (ctrl_open, ctrl_ack) lives in the connection's conn_table entry
+ * and starts closed with it.
+ */
+enum { CHAN_FULL = -1, CHAN_SKIP = 0, CHAN_APPLY = 1 };
+
+/* Host task only. Decide what to do with `seq` from `conn_handle`. */
+static int ctrl_chan_accept(uint16_t conn_handle, uint16_t seq)
+{
+    conn_ctx_t *ch = conn_table_get(conn_handle);
+    int verdict;
+
+    if (ch == NULL) {
+        return CHAN_FULL;
     }
-    return count;
+    portENTER_CRITICAL(&s_state_mux);
+    ch->role = CONN_ROLE_REMOTE;
+    if (!ch->ctrl_open) {
+        ch->ctrl_open = true;
+        ch->ctrl_ack = seq;
+        verdict = CHAN_APPLY;
+    } else if ((uint16_t)(seq - ch->ctrl_ack) == 1) {
+        ch->ctrl_ack = seq;
+        verdict = CHAN_APPLY;
+    } else {
+        verdict = CHAN_SKIP;
+    }
+    portEXIT_CRITICAL(&s_state_mux);
+    return verdict;
 }
-int get_connection_index(uint16_t conn_handle) {
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (conn_handles[i] == conn_handle) return i;
+
+static int stat_all_encode(uint16_t conn_handle, struct os_mbuf *om);
+
+/* Status notifications go through status_notify, which enforces a minimum
+ * interval per characteristic and merges changes inside the window. */
+enum {
+    NOTIFY_STAT_ALL,
+    NOTIFY_STAT_RPM,
+    NOTIFY_STAT_ANGLE,
+    NOTIFY_STAT_LIGHT,
+    NOTIFY_STAT_POWER,
+    NOTIFY_SLOT_COUNT
+};
+
+static const status_notify_cfg_t s_notify_cfg[NOTIFY_SLOT_COUNT] = {
+    [NOTIFY_STAT_ALL]   = { &stat_all_handle,   CONFIG_FAN_NOTIFY_STATUS_INTERVAL_MS, stat_all_encode },
+    [NOTIFY_STAT_RPM]   = { &stat_rpm_handle,   CONFIG_FAN_NOTIFY_FIELD_INTERVAL_MS },
+    [NOTIFY_STAT_ANGLE] = { &stat_angle_handle, CONFIG_FAN_NOTIFY_FIELD_INTERVAL_MS },
+    [NOTIFY_STAT_LIGHT] = { &stat_light_handle, CONFIG_FAN_NOTIFY_FIELD_INTERVAL_MS },
+    [NOTIFY_STAT_POWER] = { &stat_power_handle, CONFIG_FAN_NOTIFY_FIELD_INTERVAL_MS },
+};
+
+static uint8_t g_beacon_wifi = FAN_BEACON_WIFI_NONE;
+
+/* Show the current status in the advertising beacon; fan_adv only rewrites
+ * the advertising data if it differs from what is there. */
+static void beacon_refresh(void)
+{
+    fan_beacon_t b;
+
+    portENTER_CRITICAL(&s_state_mux);
+    b.power = g_stat_power;
+    b.light = g_stat_light;
+    b.rpm   = g_stat_rpm;
+    b.angle = g_stat_angle;
+    b.wifi  = g_beacon_wifi;
+    portEXIT_CRITICAL(&s_state_mux);
+    fan_adv_set_beacon(&b);
+}
+
+void gatt_svr_wifi_state(wifi_mgr_state_t state)
+{
+    static const uint8_t wifi[] = {
+        [WIFI_MGR_IDLE]         = FAN_BEACON_WIFI_NONE,
+        [WIFI_MGR_CONNECTING]   = FAN_BEACON_WIFI_CONNECTING,
+        [WIFI_MGR_CONNECTED]    = FAN_BEACON_WIFI_CONNECTED,
+        [WIFI_MGR_DISCONNECTED] = FAN_BEACON_WIFI_DISCONNECTED,
+    };
+
+    portENTER_CRITICAL(&s_state_mux);
+    g_beacon_wifi = wifi[state];
+    portEXIT_CRITICAL(&s_state_mux);
+    beacon_refresh();
+}
+
+/* Single publication point for status changes. `changed` is a mask of
+ * FAN_CMD_F_* bits whose status value actually moved. The aggregate
+ * characteristic always carries the full state; the legacy per-field ones
+ * are only touched for fields that changed, and so is the beacon. */
+static void status_publish(uint32_t changed)
+{
+    uint32_t slots = 1u << NOTIFY_STAT_ALL;
+
+    if (changed & FAN_CMD_F_RPM)   slots |= 1u << NOTIFY_STAT_RPM;
+    if (changed & FAN_CMD_F_ANGLE) slots |= 1u << NOTIFY_STAT_ANGLE;
+    if (changed & FAN_CMD_F_LIGHT) slots |= 1u << NOTIFY_STAT_LIGHT;
+    if (changed & FAN_CMD_F_POWER) slots |= 1u << NOTIFY_STAT_POWER;
+    status_notify_mark(slots);
+    if (changed) {
+        beacon_refresh();
     }
-    return -1;
 }
 
-/* --- Global control/status variables (unchanged) --- */
-static uint32_t g_ctrl_rpm = 0;
-static uint32_t g_ctrl_angle = 0;
-static uint8_t  g_ctrl_light = 0;
-static uint8_t  g_ctrl_power = 0;
+/* GAP event hooks (main.c): keep the per-connection subscription bitmap
+ * and counters */
+void gatt_svr_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify)
+{
+    status_notify_subscribe(conn_handle, attr_handle, notify);
+}
 
-static uint32_t g_stat_rpm = 0;
-static uint32_t g_stat_angle = 0;
-static uint8_t  g_stat_light = 0;
-static uint8_t  g_stat_power = 0;
+void gatt_svr_on_disconnect(uint16_t conn_handle)
+{
+    status_notify_conn_closed(conn_handle);
+}
 
-/* Accessors */
-static inline uint32_t current_ctrl_rpm(void)   { return g_ctrl_rpm; }
-static inline uint32_t current_ctrl_angle(void) { return g_ctrl_angle; }
-static inline uint8_t  current_ctrl_light(void) { return g_ctrl_light; }
-static inline uint8_t  current_ctrl_power(void) { return g_ctrl_power; }
+void gatt_svr_on_notify_tx(uint16_t conn_handle, uint16_t attr_handle, int status)
+{
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    if (c) {
+        if (status == 0) {
+            c->stats.tx_notify++;
+        } else {
+            c->stats.tx_fail++;
+        }
+    }
+}
 
-static inline uint32_t current_stat_rpm(void)   { return g_stat_rpm; }
-static inline uint32_t current_stat_angle(void) { return g_stat_angle; }
-static inline uint8_t  current_stat_light(void) { return g_stat_light; }
-static inline uint8_t  current_stat_power(void) { return g_stat_power; }
+/* Consistent copy of the whole status for the aggregate characteristic,
+ * with the control channel ack of the connection it is for */
+static void status_snapshot(fan_status_t *st, uint16_t conn_handle)
+{
+    conn_ctx_t *c = conn_table_get(conn_handle);
+
+    st->version = FAN_STATUS_VERSION;
+    st->flags = 0;
+    st->ack = 0;
+    portENTER_CRITICAL(&s_state_mux);
+    st->power = g_stat_power;
+    st->light = g_stat_light;
+    st->rpm   = g_stat_rpm;
+    st->angle = g_stat_angle;
+    st->seq   = g_stat_seq;
+    st->clock = (uint16_t)g_ctrl_clock;
+    if (c && c->ctrl_open) {
+        st->ack = c->ctrl_ack;
+        st->flags |= FAN_STATUS_F_ACK;
+    }
+    portEXIT_CRITICAL(&s_state_mux);
+}
 
-/* schedule_* functions already in your code — they update status and notify */
-static void schedule_set_rpm(uint32_t rpm)
+/* status_notify encoder for the aggregate characteristic */
+static int stat_all_encode(uint16_t conn_handle, struct os_mbuf *om)
 {
-    g_stat_rpm = rpm;
-    ble_gatts_chr_updated(stat_rpm_handle);
+    fan_status_t st;
+    status_snapshot(&st, conn_handle);
+    return os_mbuf_append(om, &st, sizeof(st));
 }
-static void schedule_set_angle(uint32_t angle)
+
+/* Consistent copy of the desired (control) state */
+static void ctrl_snapshot(fan_state_t *st)
 {
-    g_stat_angle = angle;
-    ble_gatts_chr_updated(stat_angle_handle);
+    portENTER_CRITICAL(&s_state_mux);
+    st->rpm   = g_ctrl_rpm;
+    st->angle = g_ctrl_angle;
+    st->light = g_ctrl_light;
+    st->power = g_ctrl_power;
+    portEXIT_CRITICAL(&s_state_mux);
 }
-static void schedule_set_light(uint8_t light)
+
+/* Apply every staged field to g_ctrl_* at once and hand the result to the
+ * actuator. Never blocks. Returns the mask of control fields that changed. */
+static uint32_t ctrl_txn_apply(const ctrl_txn_t *txn)
 {
-    g_stat_light = light;
-    ble_gatts_chr_updated(stat_light_handle);
+    uint32_t changed = 0;
+    fan_state_t desired;
+
+    portENTER_CRITICAL(&s_state_mux);
+    if ((txn->fields & FAN_CMD_F_RPM) && g_ctrl_rpm != txn->rpm) {
+        g_ctrl_rpm = txn->rpm;
+        changed |= FAN_CMD_F_RPM;
+    }
+    if ((txn->fields & FAN_CMD_F_ANGLE) && g_ctrl_angle != txn->angle) {
+        g_ctrl_angle = txn->angle;
+        changed |= FAN_CMD_F_ANGLE;
+    }
+    if ((txn->fields & FAN_CMD_F_LIGHT) && g_ctrl_light != txn->light) {
+        g_ctrl_light = txn->light;
+        changed |= FAN_CMD_F_LIGHT;
+    }
+    if ((txn->fields & FAN_CMD_F_POWER) && g_ctrl_power != txn->power) {
+        g_ctrl_power = txn->power;
+        changed |= FAN_CMD_F_POWER;
+    }
+    if (changed) {
+        desired.rpm   = g_ctrl_rpm;
+        desired.angle = g_ctrl_angle;
+        desired.light = g_ctrl_light;
+        desired.power = g_ctrl_power;
+        /* posting under the lock keeps the mailbox single-producer */
+        fan_actuator_post(&desired);
+    }
+    portEXIT_CRITICAL(&s_state_mux);
+
+    if (changed) {
+        fan_actuator_kick();
+    }
+    return changed;
 }
-static void schedule_set_power(uint8_t power)
+
+/* Client-initiated commit from `writer`. Fields a newer write already owns
+ * are dropped and the writer is sent the winning state at once; a direct
+ * write to a field the profile engine is driving stops the profile first,
+ * so manual control always wins. */
+static uint32_t ctrl_txn_commit(ctrl_txn_t *txn, uint16_t writer)
 {
-    g_stat_power = power;
-    ble_gatts_chr_updated(stat_power_handle);
+    conn_ctx_t *c = conn_table_get(writer);
+    uint32_t changed;
+
+    portENTER_CRITICAL(&s_state_mux);
+    if (c && c->role == CONN_ROLE_UNKNOWN) {
+        c->role = CONN_ROLE_PHONE;
+    }
+    ctrl_txn_merge(txn, writer);
+    portEXIT_CRITICAL(&s_state_mux);
+
+    if (txn->rejected) {
+        status_notify_conn_mark(writer, 1u << NOTIFY_STAT_ALL);
+    }
+    fan_profile_cancel(txn->fields);
+    changed = ctrl_txn_apply(txn);
+    if (txn->fields && changed == 0) {
+        /* same values, newer clock: clients still need to see it */
+        status_publish(0);
+    }
+    return changed;
+}
+
+/* Profile engine output (esp_timer task): one trajectory point */
+static void profile_output(uint32_t fields, uint32_t rpm, uint32_t angle)
+{
+    ctrl_txn_t txn;
+
+    ctrl_txn_begin(&txn);
+    if (fields & FAN_CMD_F_RPM)   ctrl_txn_set_rpm(&txn, rpm);
+    if (fields & FAN_CMD_F_ANGLE) ctrl_txn_set_angle(&txn, angle);
+    ctrl_txn_apply(&txn);
+}
+
+/* Actuator task callback: the state it just drove becomes the status */
+void gatt_svr_status_applied(const struct fan_state *applied)
+{
+    uint32_t changed = 0;
+
+    portENTER_CRITICAL(&s_state_mux);
+    if (g_stat_rpm != applied->rpm)     { g_stat_rpm = applied->rpm;     changed |= FAN_CMD_F_RPM; }
+    if (g_stat_angle != applied->angle) { g_stat_angle = applied->angle; changed |= FAN_CMD_F_ANGLE; }
+    if (g_stat_light != applied->light) { g_stat_light = applied->light; changed |= FAN_CMD_F_LIGHT; }
+    if (g_stat_power != applied->power) { g_stat_power = applied->power; changed |= FAN_CMD_F_POWER; }
+    if (changed) {
+        g_stat_seq++;
+    }
+    portEXIT_CRITICAL(&s_state_mux);
+
+    /* notify outside the critical section; the host may block on mbufs */
+    if (changed) {
+        status_publish(changed);
+    }
 }
 
 /* --- GATT UUIDs (unchanged + new packet UUID) --- */
@@ -132,27 +482,19 @@ static const ble_uuid128_t control_svc_uuid = BLE_UUID128_INIT(
 static const ble_uuid128_t status_svc_uuid  = BLE_UUID128_INIT(
     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x32,0x43,0x54,0x65,0x76,0x87,0xAA,0xAA,0xAA,0xAA);
 
+// Characteristic UUIDs for the V() entries (RPM, Angle, Light, Power in both services)
+ALL_CHRS(CHR_GEN_UUID_V, CHR_GEN_NONE)
 
+// Aggregate status (all fields in one fan_status_t)
+static const ble_uuid128_t stat_all_uuid   = BLE_UUID128_INIT(
+    0x05,0x57,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
 
-
-// Characteristic UUIDs for RPM, Angle, Light, Power (Control service)
-static const ble_uuid128_t ctrl_rpm_uuid   = BLE_UUID128_INIT(
-    0x01,0xC7,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
-static const ble_uuid128_t ctrl_angle_uuid = BLE_UUID128_INIT(
-    0x02,0xC7,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98); 
-static const ble_uuid128_t ctrl_light_uuid = BLE_UUID128_INIT(
-    0x03,0xC7,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
-static const ble_uuid128_t ctrl_power_uuid = BLE_UUID128_INIT(
-    0x04,0xC7,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
-// Characteristic UUIDs for RPM, Angle, Light, Power (Status service)
-static const ble_uuid128_t stat_rpm_uuid   = BLE_UUID128_INIT(
-    0x01,0x57,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
-static const ble_uuid128_t stat_angle_uuid = BLE_UUID128_INIT(
-    0x02,0x57,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
-static const ble_uuid128_t stat_light_uuid = BLE_UUID128_INIT(
-    0x03,0x57,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
-static const ble_uuid128_t stat_power_uuid = BLE_UUID128_INIT(
-    0x04,0x57,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
+// Profiles: ramps, sweeps, sequences (see fan_profile.h for the commands)
+static const ble_uuid128_t profile_uuid    = BLE_UUID128_INIT(
+    0x06,0xC7,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
+// Presets (see preset_store.h for the opcodes)
+static const ble_uuid128_t preset_uuid     = BLE_UUID128_INIT(
+    0x05,0xC7,0xBE,0xEF, 0xEF,0xBE,0xAD,0xDE, 0x90,0xAB,0xCD,0xEF, 0xFE,0xDC,0xBA,0x98);
 
 /* NEW: unified packet characteristic UUID */
 static const ble_uuid128_t packet_uuid = BLE_UUID128_INIT(
@@ -173,273 +515,350 @@ static const ble_uuid128_t gatt_svr_dsc_uuid =
                      0x23, 0x23, 0x23, 0x23, 0x34, 0x34, 0x34, 0x34);
 
 
-// /* declare the control/status characteristic arrays (reuse your arrays) */
-// extern const struct ble_gatt_chr_def control_chrs[];
-// extern const struct ble_gatt_chr_def status_chrs[];
+/* ---------- Dispatch ---------- */
+
+struct gatt_chr_desc;
+typedef int (*gatt_chr_read_fn)(const struct gatt_chr_desc *d, uint16_t conn_handle,
+                                struct ble_gatt_access_ctxt *ctxt);
+typedef int (*gatt_chr_write_fn)(const struct gatt_chr_desc *d, uint16_t conn_handle,
+                                 struct ble_gatt_access_ctxt *ctxt);
+
+typedef struct gatt_chr_desc {
+    const char       *name;
+    void             *val;      /* g_<name>, NULL for C() entries */
+    uint8_t           size;     /* sizeof(*val) */
+    uint32_t          field;    /* FAN_CMD_F_* the value maps to */
+    gatt_chr_read_fn  read;     /* NULL: not readable */
+    gatt_chr_write_fn write;    /* NULL: not writable */
+} gatt_chr_desc_t;
+
+/* Attribute handles are small and dense, so a flat array indexed by handle
+ * is enough for O(1) lookup. Entries hold descriptor index + 1, 0 = none. */
+#define GATT_SVR_MAX_HANDLES 128
+static uint8_t s_chr_by_handle[GATT_SVR_MAX_HANDLES];
 
-/* local helper: safe write of om into flat buffer */
 static int
-gatt_svr_write_flat(struct os_mbuf *om, uint16_t min_len, uint16_t max_len,
-               void *dst, uint16_t *out_len)
+chr_read_value(const gatt_chr_desc_t *d, uint16_t conn_handle,
+               struct ble_gatt_access_ctxt *ctxt)
 {
-    uint16_t om_len = OS_MBUF_PKTLEN(om);
-    if (om_len < min_len || om_len > max_len) {
+    int rc = os_mbuf_append(ctxt->om, d->val, d->size);
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int
+chr_read_stat_all(const gatt_chr_desc_t *d, uint16_t conn_handle,
+                  struct ble_gatt_access_ctxt *ctxt)
+{
+    int rc = stat_all_encode(conn_handle, ctxt->om);
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+/* Control small numeric characteristic writes: a one-field transaction */
+static int
+chr_write_ctrl(const gatt_chr_desc_t *d, uint16_t conn_handle,
+               struct ble_gatt_access_ctxt *ctxt)
+{
+    mbuf_cursor_t c;
+    uint32_t v;
+
+    /* value read straight from the mbuf chain, no flat copy */
+    mbuf_cursor_init(&c, ctxt->om);
+    if (mbuf_cursor_left(&c) != d->size || mbuf_cursor_le(&c, d->size, &v) != 0) {
         return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
     }
-    int rc = ble_hs_mbuf_to_flat(om, dst, max_len, out_len);
-    if (rc != 0) return BLE_ATT_ERR_UNLIKELY;
+
+    ctrl_txn_t txn;
+    ctrl_txn_begin(&txn);
+    switch (d->field) {
+    case FAN_CMD_F_RPM:   ctrl_txn_set_rpm(&txn, v); break;
+    case FAN_CMD_F_ANGLE: ctrl_txn_set_angle(&txn, v); break;
+    case FAN_CMD_F_LIGHT: ctrl_txn_set_light(&txn, (uint8_t)v); break;
+    case FAN_CMD_F_POWER: ctrl_txn_set_power(&txn, (uint8_t)v); break;
+    default: return BLE_ATT_ERR_UNLIKELY;
+    }
+    ctrl_txn_commit(&txn, conn_handle);
     return 0;
 }
 
-/* ---------- Simple string parsers for your packet format ---------- */
-
-/* find the value of a numeric key "Key: <num>" in `s`. Returns true if found. */
-static bool extract_int_field(const char *s, const char *key, int *out)
-{
-    const char *p = strstr(s, key);
-    if (!p) return false;
-    p += strlen(key);
-    // skip separators and spaces and possible colon
-    while (*p && ( *p==' ' || *p==':' || *p==',' || *p=='{' || *p=='}')) p++;
-    if (!*p) return false;
-    // read integer
-    int val;
-    int scanned = sscanf(p, "%d", &val);
-    if (scanned == 1) {
-        *out = val;
-        return true;
-    }
-    return false;
-}
-
-/* find the string value of a key "SSID: 'name'" or "SSID: \"name\"" or "SSID: name" */
-static bool extract_str_field(const char *s, const char *key, char *out, size_t maxlen)
-{
-    const char *p = strstr(s, key);
-    if (!p) return false;
-    p += strlen(key);
-    while (*p && ( *p==' ' || *p==':' || *p==',' || *p=='{' || *p=='}')) p++;
-    if (!*p) return false;
-    // Accept quoted or unquoted form
-    char quote = 0;
-    if (*p == '"' || *p == '\'') { quote = *p; p++; }
-    size_t i = 0;
-    while (*p && i+1 < maxlen) {
-        if (quote) {
-            if (*p == quote) break;
-        } else {
-            // unquoted: stop at comma or closing brace
-            if (*p == ',' || *p == '}' ) break;
+/* Preset list: every used slot, back to back */
+static int
+chr_read_preset(const gatt_chr_desc_t *d, uint16_t conn_handle,
+                struct ble_gatt_access_ctxt *ctxt)
+{
+    fan_preset_t p;
+
+    for (uint8_t slot = 0; slot < PRESET_MAX; slot++) {
+        if (!preset_get(slot, &p)) {
+            continue;
+        }
+        uint8_t hdr[1 + 4 + 4 + 1 + 1 + 1];
+        hdr[0] = slot;
+        memcpy(&hdr[1], &p.state.rpm, 4);
+        memcpy(&hdr[5], &p.state.angle, 4);
+        hdr[9] = p.state.light;
+        hdr[10] = p.state.power;
+        hdr[11] = p.name_len;
+        if (os_mbuf_append(ctxt->om, hdr, sizeof(hdr)) != 0 ||
+            os_mbuf_append(ctxt->om, p.name, p.name_len) != 0) {
+            return BLE_ATT_ERR_INSUFFICIENT_RES;
         }
-        out[i++] = *p++;
-    }
-    out[i] = '\0';
-    // trim trailing spaces
-    while (i > 0 && (out[i-1] == ' ' || out[i-1] == '\r' || out[i-1] == '\n' || out[i-1] == '\t')) {
-        out[--i] = '\0';
     }
-    return i > 0;
+    return 0;
 }
 
-/* ---------- Main GATT access handler (modified) ---------- */
-
+/* Preset opcodes: one byte recalls or erases, save carries an optional name */
 static int
-gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle,
-                struct ble_gatt_access_ctxt *ctxt, void *arg)
+chr_write_preset(const gatt_chr_desc_t *d, uint16_t conn_handle,
+                 struct ble_gatt_access_ctxt *ctxt)
 {
-    int rc;
-    MODLOG_DFLT(INFO, "gatt_access: op=%d conn=%d handle=%d\n",
-                ctxt->op, conn_handle, attr_handle);
+    mbuf_cursor_t c;
+    uint8_t b;
+    fan_preset_t p;
+    fan_state_t st;
 
-    switch (ctxt->op) {
-    case BLE_GATT_ACCESS_OP_READ_CHR:
-        /* delegate to your existing read handlers (unchanged) */
-        if (attr_handle == ctrl_rpm_handle) {
-            uint32_t v = current_ctrl_rpm();
-            rc = os_mbuf_append(ctxt->om, &v, sizeof(v));
-            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
-        }
-        if (attr_handle == ctrl_angle_handle) {
-            uint32_t v = current_ctrl_angle();
-            rc = os_mbuf_append(ctxt->om, &v, sizeof(v));
-            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
-        }
-        if (attr_handle == ctrl_light_handle) {
-            uint8_t v = current_ctrl_light();
-            rc = os_mbuf_append(ctxt->om, &v, sizeof(v));
-            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
-        }
-        if (attr_handle == ctrl_power_handle) {
-            uint8_t v = current_ctrl_power();
-            rc = os_mbuf_append(ctxt->om, &v, sizeof(v));
-            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
-        }
+    mbuf_cursor_init(&c, ctxt->om);
+    if (mbuf_cursor_u8(&c, &b) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    uint8_t slot = b & PRESET_SLOT_MASK;
+    if (slot >= PRESET_MAX) {
+        return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
 
-        if (attr_handle == stat_rpm_handle) {
-            uint32_t v = current_stat_rpm();
-            rc = os_mbuf_append(ctxt->om, &v, sizeof(v));
-            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    switch (b & PRESET_OP_MASK) {
+    case PRESET_OP_RECALL:
+        if (mbuf_cursor_left(&c) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
         }
-        if (attr_handle == stat_angle_handle) {
-            uint32_t v = current_stat_angle();
-            rc = os_mbuf_append(ctxt->om, &v, sizeof(v));
-            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        if (!preset_get(slot, &p)) {
+            ESP_LOGW(TAG, "Recall of empty preset %u", slot);
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
         }
-        if (attr_handle == stat_light_handle) {
-            uint8_t v = current_stat_light();
-            rc = os_mbuf_append(ctxt->om, &v, sizeof(v));
-            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        ctrl_txn_t txn;
+        ctrl_txn_begin(&txn);
+        ctrl_txn_set_rpm(&txn, p.state.rpm);
+        ctrl_txn_set_angle(&txn, p.state.angle);
+        ctrl_txn_set_light(&txn, p.state.light);
+        ctrl_txn_set_power(&txn, p.state.power);
+        ctrl_txn_commit(&txn, conn_handle);
+        ESP_LOGI(TAG, "Recalled preset %u '%s'", slot, p.name);
+        return 0;
+
+    case PRESET_OP_SAVE: {
+        char name[PRESET_NAME_MAX];
+        uint16_t name_len = mbuf_cursor_left(&c);
+        if (name_len > PRESET_NAME_MAX) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
         }
-        if (attr_handle == stat_power_handle) {
-            uint8_t v = current_stat_power();
-            rc = os_mbuf_append(ctxt->om, &v, sizeof(v));
-            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        mbuf_cursor_read(&c, name, name_len);
+        ctrl_snapshot(&st);
+        preset_save(slot, name, (uint8_t)name_len, &st);
+        ESP_LOGI(TAG, "Saved preset %u (%u byte name)", slot, (unsigned)name_len);
+        return 0;
+    }
+
+    case PRESET_OP_ERASE:
+        if (mbuf_cursor_left(&c) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
         }
+        preset_erase(slot);
+        return 0;
 
-        /* unknown read */
-        return BLE_ATT_ERR_UNLIKELY;
+    default:
+        return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    }
+}
 
-    case BLE_GATT_ACCESS_OP_WRITE_CHR:
-        /* Control small numeric characteristic writes (unchanged behavior) */
-        if (attr_handle == ctrl_rpm_handle) {
-            rc = gatt_svr_write_flat(ctxt->om, sizeof(uint32_t), sizeof(uint32_t), &g_ctrl_rpm, NULL);
-            if (rc == 0) schedule_set_rpm(g_ctrl_rpm);
-            return rc;
-        }
-        if (attr_handle == ctrl_angle_handle) {
-            rc = gatt_svr_write_flat(ctxt->om, sizeof(uint32_t), sizeof(uint32_t), &g_ctrl_angle, NULL);
-            if (rc == 0) schedule_set_angle(g_ctrl_angle);
-            return rc;
-        }
-        if (attr_handle == ctrl_light_handle) {
-            rc = gatt_svr_write_flat(ctxt->om, sizeof(uint8_t), sizeof(uint8_t), &g_ctrl_light, NULL);
-            if (rc == 0) schedule_set_light(g_ctrl_light);
-            return rc;
-        }
-        if (attr_handle == ctrl_power_handle) {
-            rc = gatt_svr_write_flat(ctxt->om, sizeof(uint8_t), sizeof(uint8_t), &g_ctrl_power, NULL);
-            if (rc == 0) schedule_set_power(g_ctrl_power);
-            return rc;
-        }
+/* Start or stop a profile; the engine then drives rpm/angle on its own */
+static int
+chr_write_profile(const gatt_chr_desc_t *d, uint16_t conn_handle,
+                  struct ble_gatt_access_ctxt *ctxt)
+{
+    fan_profile_t prof;
+    fan_state_t from;
 
-        /* NEW: unified packet characteristic (text/JSON-like) */
-        if (attr_handle == packet_handle) {
-            /* maximum 128 bytes; expect at least 1 byte */
-            const uint16_t MAX_PKT = 128;
-            uint16_t got = 0;
-            char buf[MAX_PKT + 1];
-            memset(buf, 0, sizeof(buf));
-            rc = gatt_svr_write_flat(ctxt->om, 1, MAX_PKT, buf, &got);
-            if (rc != 0) return rc;
-
-            buf[got] = '\0'; /* ensure nul-terminated for strstr/sscanf */
-
-            ESP_LOGI(TAG, "Received packet (%u bytes): %s", (unsigned)got, buf);
-
-            /* Decide packet type: control attributes or wifi provisioning.
-               We look for tokens - "Wifi" or "SSID" to detect provisioning.
-               Control keys: Speed, Angle, Light, Power
-            */
-
-            bool handled = false;
-
-            /* If packet mentions Wifi or SSID -> treat as provisioning */
-            if (strstr(buf, "Wifi") != NULL || strstr(buf, "SSID") != NULL || strstr(buf, "ssid") != NULL) {
-                wifi_credentials_t cred;
-                memset(&cred, 0, sizeof(cred));
-                char ssid[33] = {0};
-                char pass[65] = {0};
-                bool got_ssid = extract_str_field(buf, "SSID", ssid, sizeof(ssid));
-                if (!got_ssid) {
-                    got_ssid = extract_str_field(buf, "ssid", ssid, sizeof(ssid));
-                }
-                bool got_pass = extract_str_field(buf, "PASS", pass, sizeof(pass));
-                if (!got_pass) {
-                    got_pass = extract_str_field(buf, "Pass", pass, sizeof(pass));
-                    if (!got_pass) got_pass = extract_str_field(buf, "pass", pass, sizeof(pass));
-                }
+    int rc = fan_profile_parse(ctxt->om, &prof);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "Malformed profile command; rc=%d", rc);
+        return rc;
+    }
+    if (prof.kind == FAN_PROFILE_STOP) {
+        fan_profile_stop();
+        return 0;
+    }
+    ctrl_snapshot(&from);
+    fan_profile_start(&prof, &from);
+    return 0;
+}
 
-                if (got_ssid) {
-                    cred.ssid_len = (uint8_t)strnlen(ssid, sizeof(cred.ssid));
-                    strncpy(cred.ssid, ssid, sizeof(cred.ssid)-1);
-                    if (got_pass) {
-                        cred.pass_len = (uint8_t)strnlen(pass, sizeof(cred.pass));
-                        strncpy(cred.pass, pass, sizeof(cred.pass)-1);
-                    } else {
-                        cred.pass_len = 0;
-                        cred.pass[0] = '\0';
-                    }
+/* FAN_OP_SEQ_SET: apply in order and make sure the ack goes back. When the
+ * state changes the ack rides on the status notification the actuator
+ * triggers; otherwise the writer gets a status record of its own at once. */
+static int
+ctrl_seq_write(uint16_t conn_handle, const fan_cmd_t *cmd)
+{
+    uint32_t changed = 0;
 
-                    /* Send credentials to wifi manager via queue
-                     * Note: this is safe from NimBLE host context.
-                     */
-                    extern QueueHandle_t wifi_cred_queue; /* must be created by wifi_manager_init() */
-                    if (wifi_cred_queue) {
-                        BaseType_t ok = xQueueSend(wifi_cred_queue, &cred, 0);
-                        if (ok == pdTRUE) {
-                            ESP_LOGI(TAG, "Provisioning queued SSID='%s' (len=%u) pass_len=%u", cred.ssid, cred.ssid_len, cred.pass_len);
-                            handled = true;
-                        } else {
-                            ESP_LOGW(TAG, "wifi_cred_queue full or not available");
-                            /* return an ATT error to the writer */
-                            return BLE_ATT_ERR_UNLIKELY;
-                        }
-                    } else {
-                        ESP_LOGE(TAG, "wifi_cred_queue not initialised");
-                        return BLE_ATT_ERR_UNLIKELY;
-                    }
+    int verdict = ctrl_chan_accept(conn_handle, cmd->seq);
+    if (verdict == CHAN_FULL) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    if (verdict == CHAN_APPLY) {
+        ctrl_txn_t txn;
+        ctrl_txn_begin(&txn);
+        if (cmd->fields & FAN_CMD_F_RPM)   ctrl_txn_set_rpm(&txn, cmd->rpm);
+        if (cmd->fields & FAN_CMD_F_ANGLE) ctrl_txn_set_angle(&txn, cmd->angle);
+        if (cmd->fields & FAN_CMD_F_LIGHT) ctrl_txn_set_light(&txn, cmd->light);
+        if (cmd->fields & FAN_CMD_F_POWER) ctrl_txn_set_power(&txn, cmd->power);
+        if (cmd->fields & FAN_CMD_F_CLOCK) ctrl_txn_set_clock(&txn, cmd->clock);
+        changed = ctrl_txn_commit(&txn, conn_handle);
+    } else {
+        ESP_LOGD(TAG, "seq %u from conn %u out of order, re-acking", cmd->seq, conn_handle);
+    }
+    if (changed == 0) {
+        status_notify_conn_mark(conn_handle, 1u << NOTIFY_STAT_ALL);
+    }
+    return 0;
+}
+
+/* NEW: unified packet characteristic (text/JSON-like or binary TLV) */
+static int
+chr_write_packet(const gatt_chr_desc_t *d, uint16_t conn_handle,
+                 struct ble_gatt_access_ctxt *ctxt)
+{
+    int rc;
+
+    /* maximum 128 bytes; expect at least 1 byte */
+    const uint16_t MAX_PKT = 128;
+    uint16_t got = OS_MBUF_PKTLEN(ctxt->om);
+    if (got < 1 || got > MAX_PKT) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    /* Text or binary TLV, decided by the first byte. Single pass over
+     * the mbuf chain; no flat copy, no strstr. */
+    fan_cmd_t cmd;
+    rc = fan_cmd_parse(ctxt->om, &cmd);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "Malformed packet (%u bytes); rc=%d", (unsigned)got, rc);
+        return rc;
+    }
+
+    if (cmd.op == FAN_OP_SEQ_SET) {
+        /* hot path for the remote: no provisioning, no log per packet */
+        return ctrl_seq_write(conn_handle, &cmd);
+    }
+
+    ESP_LOGI(TAG, "Received packet (%u bytes) fields=0x%02" PRIx32, (unsigned)got, cmd.fields);
+
+    /* Decide packet type: control attributes or wifi provisioning.
+       A "Wifi" marker or an SSID key means provisioning.
+       Control keys: Speed, Angle, Light, Power
+    */
+
+    bool handled = false;
+
+    /* If packet mentions Wifi or SSID -> treat as provisioning */
+    if (cmd.fields & FAN_CMD_F_PROV) {
+        if (cmd.fields & FAN_CMD_F_SSID) {
+            /* Send credentials to wifi manager via queue
+             * Note: this is safe from NimBLE host context.
+             */
+            extern QueueHandle_t wifi_cred_queue; /* must be created by wifi_manager_init() */
+            if (wifi_cred_queue) {
+                BaseType_t ok = xQueueSend(wifi_cred_queue, &cmd.cred, 0);
+                if (ok == pdTRUE) {
+                    ESP_LOGI(TAG, "Provisioning queued SSID='%s' (len=%u) pass_len=%u", cmd.cred.ssid, cmd.cred.ssid_len, cmd.cred.pass_len);
+                    handled = true;
                 } else {
-                    ESP_LOGW(TAG, "SSID not found in provisioning packet");
+                    ESP_LOGW(TAG, "wifi_cred_queue full or not available");
+                    /* return an ATT error to the writer */
                     return BLE_ATT_ERR_UNLIKELY;
                 }
             } else {
-                /* Control packet: parse numeric fields and apply state actions directly.
-                   We update g_ctrl_* variables and call schedule_set_* which notifies subscribers.
-                   Because this callback runs on NimBLE host, calling schedule_set_*() is acceptable.
-                */
-                int val;
-                if (extract_int_field(buf, "Speed", &val) || extract_int_field(buf, "speed", &val)) {
-                    if (val >= 0) {
-                        g_ctrl_rpm = (uint32_t)val;
-                        schedule_set_rpm(g_ctrl_rpm);
-                        handled = true;
-                    }
-                }
-                if (extract_int_field(buf, "Angle", &val) || extract_int_field(buf, "angle", &val)) {
-                    if (val >= 0) {
-                        g_ctrl_angle = (uint32_t)val;
-                        schedule_set_angle(g_ctrl_angle);
-                        handled = true;
-                    }
-                }
-                if (extract_int_field(buf, "Light", &val) || extract_int_field(buf, "light", &val)) {
-                    if (val >= 0) {
-                        g_ctrl_light = (uint8_t)val;
-                        schedule_set_light(g_ctrl_light);
-                        handled = true;
-                    }
-                }
-                if (extract_int_field(buf, "Power", &val) || extract_int_field(buf, "power", &val)) {
-                    if (val >= 0) {
-                        g_ctrl_power = (uint8_t)val;
-                        schedule_set_power(g_ctrl_power);
-                        handled = true;
-                    }
-                }
+                ESP_LOGE(TAG, "wifi_cred_queue not initialised");
+                return BLE_ATT_ERR_UNLIKELY;
             }
+        } else {
+            ESP_LOGW(TAG, "SSID not found in provisioning packet");
+            return BLE_ATT_ERR_UNLIKELY;
+        }
+    } else {
+        /* Control packet: stage every decoded field and commit them
+           as one transaction, so subscribers get one status update
+           per packet instead of one per field.
+        */
+        ctrl_txn_t txn;
+        ctrl_txn_begin(&txn);
+        if (cmd.fields & FAN_CMD_F_RPM)   ctrl_txn_set_rpm(&txn, cmd.rpm);
+        if (cmd.fields & FAN_CMD_F_ANGLE) ctrl_txn_set_angle(&txn, cmd.angle);
+        if (cmd.fields & FAN_CMD_F_LIGHT) ctrl_txn_set_light(&txn, cmd.light);
+        if (cmd.fields & FAN_CMD_F_POWER) ctrl_txn_set_power(&txn, cmd.power);
+        if (cmd.fields & FAN_CMD_F_CLOCK) ctrl_txn_set_clock(&txn, cmd.clock);
+        if (txn.fields) {
+            uint32_t changed = ctrl_txn_commit(&txn, conn_handle);
+            ESP_LOGI(TAG, "Control txn fields=0x%02" PRIx32 " changed=0x%02" PRIx32, txn.fields, changed);
+            handled = true;
+        }
+    }
 
-            if (!handled) {
-                ESP_LOGW(TAG, "Packet not handled or no known keys found");
-                /* returning an ATT error informs writer of failure; use 0 if you prefer success */
-                return 0;
-            }
+    if (!handled) {
+        ESP_LOGW(TAG, "Packet not handled or no known keys found");
+        /* returning an ATT error informs writer of failure; use 0 if you prefer success */
+        return 0;
+    }
+
+    /* success */
+    return 0;
+}
 
-            /* success */
-            return 0;
-        } /* end packet_handle case */
+#define CHR_GEN_DESC_V(name, u0, u1, type, field, flags, wr) \
+    [CHR_##name] = { #name, &g_##name, sizeof(type), field, chr_read_value, wr },
+#define CHR_GEN_DESC_C(name, flags, rd, wr) \
+    [CHR_##name] = { #name, NULL, 0, 0, rd, wr },
 
-        /* write to status chars not permitted */
-        return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+static const gatt_chr_desc_t s_chr_desc[CHR_COUNT] = {
+    ALL_CHRS(CHR_GEN_DESC_V, CHR_GEN_DESC_C)
+};
+
+static inline const gatt_chr_desc_t *chr_desc_lookup(uint16_t attr_handle)
+{
+    if (attr_handle >= GATT_SVR_MAX_HANDLES || s_chr_by_handle[attr_handle] == 0) {
+        return NULL;
+    }
+    return &s_chr_desc[s_chr_by_handle[attr_handle] - 1];
+}
+
+/* ---------- Main GATT access handler (modified) ---------- */
+
+static int
+gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle,
+                struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    int rc;
+    const gatt_chr_desc_t *d;
+    MODLOG_DFLT(DEBUG, "gatt_access: op=%d conn=%d handle=%d\n",
+                ctxt->op, conn_handle, attr_handle);
+
+    switch (ctxt->op) {
+    case BLE_GATT_ACCESS_OP_READ_CHR:
+        d = chr_desc_lookup(attr_handle);
+        if (d == NULL || d->read == NULL) {
+            /* unknown read */
+            return BLE_ATT_ERR_UNLIKELY;
+        }
+        return d->read(d, conn_handle, ctxt);
+
+    case BLE_GATT_ACCESS_OP_WRITE_CHR:
+        d = chr_desc_lookup(attr_handle);
+        if (d == NULL || d->write == NULL) {
+            /* write to status chars not permitted */
+            return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+        }
+        conn_table_touch(conn_handle);
+        rc = d->write(d, conn_handle, ctxt);
+        conn_params_activity(conn_handle);
+        return rc;
 
     case BLE_GATT_ACCESS_OP_READ_DSC:
         if (arg && ctxt->dsc && ble_uuid_cmp(ctxt->dsc->uuid, &gatt_svr_dsc_uuid.u) == 0) {
@@ -457,10 +876,11 @@ gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle,
     }
 }
 
-/* register callback unchanged from your code */
+/* register callback unchanged from your code, plus handle -> descriptor mapping */
 void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
 {
     char buf_uuid[BLE_UUID_STR_LEN];
+    const gatt_chr_desc_t *d;
     switch (ctxt->op) {
     case BLE_GATT_REGISTER_OP_SVC:
         MODLOG_DFLT(DEBUG, "registered service %s with handle=%d\n",
@@ -471,6 +891,12 @@ void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
         MODLOG_DFLT(DEBUG, "registering characteristic %s with def_handle=%d val_handle=%d\n",
                     ble_uuid_to_str(ctxt->chr.chr_def->uuid, buf_uuid),
                     ctxt->chr.def_handle, ctxt->chr.val_handle);
+        /* table entries carry their descriptor in .arg */
+        d = ctxt->chr.chr_def->arg;
+        if (d >= &s_chr_desc[0] && d < &s_chr_desc[CHR_COUNT]) {
+            assert(ctxt->chr.val_handle < GATT_SVR_MAX_HANDLES);
+            s_chr_by_handle[ctxt->chr.val_handle] = (uint8_t)(d - s_chr_desc) + 1;
+        }
         break;
     case BLE_GATT_REGISTER_OP_DSC:
         MODLOG_DFLT(DEBUG, "registering descriptor %s with handle=%d\n",
@@ -487,30 +913,22 @@ void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
    You may instead add it to the control service.
 */
 
-/* --- existing control and status arrays (you already have them) --- */
+/* --- control and status arrays, generated from CONTROL_CHRS/STATUS_CHRS --- */
 
-static const struct ble_gatt_chr_def control_chrs_local[] = {
-    { .uuid = &ctrl_rpm_uuid.u,   .access_cb = gatt_svc_access, .val_handle = &ctrl_rpm_handle,   .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE },
-    { .uuid = &ctrl_angle_uuid.u, .access_cb = gatt_svc_access, .val_handle = &ctrl_angle_handle, .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE },
-    { .uuid = &ctrl_light_uuid.u, .access_cb = gatt_svc_access, .val_handle = &ctrl_light_handle, .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE },
-    { .uuid = &ctrl_power_uuid.u, .access_cb = gatt_svc_access, .val_handle = &ctrl_power_handle, .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE },
-
-    /* NEW unified packet char - writable up to 128 bytes */
-    {
-        .uuid = &packet_uuid.u,
-        .access_cb = gatt_svc_access,
-        .val_handle = &packet_handle,
-        .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP
-    },
+#define CHR_GEN_DEF_V(name, u0, u1, type, field, chr_flags, wr) \
+    { .uuid = &name##_uuid.u, .access_cb = gatt_svc_access, .arg = (void *)&s_chr_desc[CHR_##name], \
+      .val_handle = &name##_handle, .flags = chr_flags },
+#define CHR_GEN_DEF_C(name, chr_flags, rd, wr) \
+    { .uuid = &name##_uuid.u, .access_cb = gatt_svc_access, .arg = (void *)&s_chr_desc[CHR_##name], \
+      .val_handle = &name##_handle, .flags = chr_flags },
 
+static const struct ble_gatt_chr_def control_chrs_local[] = {
+    CONTROL_CHRS(CHR_GEN_DEF_V, CHR_GEN_DEF_C)
     { 0 }  /* End */
 };
 
 static const struct ble_gatt_chr_def status_chrs_local[] = {
-    { .uuid = &stat_rpm_uuid.u,   .access_cb = gatt_svc_access, .val_handle = &stat_rpm_handle,   .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY },
-    { .uuid = &stat_angle_uuid.u, .access_cb = gatt_svc_access, .val_handle = &stat_angle_handle, .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY },
-    { .uuid = &stat_light_uuid.u, .access_cb = gatt_svc_access, .val_handle = &stat_light_handle, .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY },
-    { .uuid = &stat_power_uuid.u, .access_cb = gatt_svc_access, .val_handle = &stat_power_handle, .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY },
+    STATUS_CHRS(CHR_GEN_DEF_V, CHR_GEN_DEF_C)
     { 0 }
 };
 
@@ -570,6 +988,14 @@ int gatt_svr_init(void)
     if (rc != 0) {
         return rc;
     }
+    rc = status_notify_init(s_notify_cfg, NOTIFY_SLOT_COUNT);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = fan_profile_init(profile_output);
+    if (rc != 0) {
+        return rc;
+    }
     /* your descriptor init */
     gatt_svr_dsc_val = 0x99;
     return 0;
@@ -44,6 +44,12 @@
 #include "lwip/netdb.h"
 #include "lwip/sockets.h"
 #include "wifi_manager.h" 
+#include "fan_actuator.h"
+#include "preset_store.h"
+#include "conn_table.h"
+#include "fan_adv.h"
+#include "fan_status.h"
+#include "conn_params.h"
 
 #define EXAMPLE_ESP_WIFI_SSID      CONFIG_EXAMPLE_ESP_WIFI_SSID
 #define EXAMPLE_ESP_WIFI_PASS      CONFIG_EXAMPLE_ESP_WIFI_PASSWORD
@@ -302,69 +308,30 @@ bleprph_print_conn_desc(struct ble_gap_conn_desc *desc)
                 desc->sec_state.bonded);
 }
 
+
 /**
- * Enables advertising with the following parameters:
- *     o General discoverable mode.
- *     o Undirected connectable mode.
+ * Asks for the 2M PHY and the largest LL data length on a new link. Either
+ * request may be refused (a BLE 4.2 controller has no 2M PHY, an older peer
+ * may not support DLE); the link then stays on 1M / 27 bytes. The PHY and
+ * data length events record what was agreed in the connection table.
  */
 static void
-bleprph_advertise(void)
+bleprph_link_setup(uint16_t conn_handle)
 {
-    struct ble_gap_adv_params adv_params;
-    struct ble_hs_adv_fields fields;
-    const char *name;
     int rc;
 
-    /**
-     *  Set the advertisement data included in our advertisements:
-     *     o Flags (indicates advertisement type and other general info).
-     *     o Advertising tx power.
-     *     o Device name.
-     *     o 16-bit service UUIDs (alert notifications).
-     */
-
-    memset(&fields, 0, sizeof fields);
-
-    /* Advertise two flags:
-     *     o Discoverability in forthcoming advertisement (general)
-     *     o BLE-only (BR/EDR unsupported).
-     */
-    fields.flags = BLE_HS_ADV_F_DISC_GEN |
-                   BLE_HS_ADV_F_BREDR_UNSUP;
-
-    /* Indicate that the TX power level field should be included; have the
-     * stack fill this value automatically.  This is done by assigning the
-     * special value BLE_HS_ADV_TX_PWR_LVL_AUTO.
-     */
-    fields.tx_pwr_lvl_is_present = 1;
-    fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
-
-    name = ble_svc_gap_device_name();
-    fields.name = (uint8_t *)name;
-    fields.name_len = strlen(name);
-    fields.name_is_complete = 1;
-
-    fields.uuids16 = (ble_uuid16_t[]) {
-        BLE_UUID16_INIT(GATT_SVR_SVC_ALERT_UUID)
-    };
-    fields.num_uuids16 = 1;
-    fields.uuids16_is_complete = 1;
-
-    rc = ble_gap_adv_set_fields(&fields);
+#if CONFIG_BT_NIMBLE_50_FEATURE_SUPPORT
+    rc = ble_gap_set_prefered_le_phy(conn_handle, BLE_GAP_LE_PHY_2M_MASK,
+                                     BLE_GAP_LE_PHY_2M_MASK,
+                                     BLE_GAP_LE_PHY_CODED_ANY);
     if (rc != 0) {
-        ESP_LOGE(TAG, "error setting advertisement data; rc=%d", rc);
-        return;
+        ESP_LOGW(TAG, "2M PHY request failed; staying on 1M; rc=%d", rc);
     }
+#endif
 
-    /* Begin advertising. */
-    memset(&adv_params, 0, sizeof adv_params);
-    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
-    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
-    rc = ble_gap_adv_start(own_addr_type, NULL, BLE_HS_FOREVER,
-                           &adv_params, bleprph_gap_event, NULL);
+    rc = ble_gap_set_data_len(conn_handle, CONN_LL_OCTETS_MAX, CONN_LL_TIME_MAX);
     if (rc != 0) {
-        ESP_LOGE(TAG, "error enabling advertisement; rc=%d", rc);
-        return;
+        ESP_LOGW(TAG, "data length request failed; rc=%d", rc);
     }
 }
 
@@ -387,6 +354,8 @@ static int
 bleprph_gap_event(struct ble_gap_event *event, void *arg)
 {
     struct ble_gap_conn_desc desc;
+    conn_ctx_t *c;
+    bool remote;
     int rc;
 
     switch (event->type) {
@@ -399,20 +368,35 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
             rc = ble_gap_conn_find(event->connect.conn_handle, &desc);
             assert(rc == 0);
             bleprph_print_conn_desc(&desc);
-        }
 
-        if (event->connect.status != 0) {
-            /* Connection failed; resume advertising. */
-            bleprph_advertise();
+            if (conn_table_add(event->connect.conn_handle) == NULL) {
+                ble_gap_terminate(event->connect.conn_handle, BLE_ERR_CONN_LIMIT);
+                return 0;
+            }
+            conn_params_on_connect(event->connect.conn_handle);
+            bleprph_link_setup(event->connect.conn_handle);
+            fan_adv_on_connect(&desc);
         }
+
+        /* Connection failed, or room for another client: keep advertising. */
+        fan_adv_resume();
         return 0;
 
     case BLE_GAP_EVENT_DISCONNECT:
         ESP_LOGI(TAG, "disconnect; reason=%d ", event->disconnect.reason);
         bleprph_print_conn_desc(&event->disconnect.conn);
-
-        /* Connection terminated; resume advertising. */
-        bleprph_advertise();
+        c = conn_table_get(event->disconnect.conn.conn_handle);
+        remote = c != NULL && c->role == CONN_ROLE_REMOTE;
+        gatt_svr_on_disconnect(event->disconnect.conn.conn_handle);
+        conn_table_remove(event->disconnect.conn.conn_handle);
+
+        /* Connection terminated. Win the remote back first; anyone else
+         * gets fast advertising so it can come straight back. */
+        if (remote) {
+            fan_adv_reconnect(&event->disconnect.conn);
+        } else {
+            fan_adv_kick();
+        }
         return 0;
 
     case BLE_GAP_EVENT_CONN_UPDATE:
@@ -422,12 +406,15 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
         rc = ble_gap_conn_find(event->conn_update.conn_handle, &desc);
         assert(rc == 0);
         bleprph_print_conn_desc(&desc);
+        conn_params_on_update(event->conn_update.conn_handle,
+                              event->conn_update.status);
         return 0;
 
     case BLE_GAP_EVENT_ADV_COMPLETE:
         ESP_LOGI(TAG, "advertise complete; reason=%d",
                     event->adv_complete.reason);
-        bleprph_advertise();
+        /* also the end of the fast phase: continues slow */
+        fan_adv_resume();
         return 0;
 
     case BLE_GAP_EVENT_ENC_CHANGE:
@@ -439,6 +426,14 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
         bleprph_print_conn_desc(&desc);
         return 0;
 
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        if (!event->notify_tx.indication) {
+            gatt_svr_on_notify_tx(event->notify_tx.conn_handle,
+                                  event->notify_tx.attr_handle,
+                                  event->notify_tx.status);
+        }
+        return 0;
+
     case BLE_GAP_EVENT_SUBSCRIBE:
         ESP_LOGI(TAG, "subscribe event; conn_handle=%d attr_handle=%d "
                     "reason=%d prevn=%d curn=%d previ=%d curi=%d",
@@ -449,6 +444,9 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
                     event->subscribe.cur_notify,
                     event->subscribe.prev_indicate,
                     event->subscribe.cur_indicate);
+        gatt_svr_on_subscribe(event->subscribe.conn_handle,
+                              event->subscribe.attr_handle,
+                              event->subscribe.cur_notify);
         return 0;
 
     case BLE_GAP_EVENT_MTU:
@@ -456,6 +454,41 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
                     event->mtu.conn_handle,
                     event->mtu.channel_id,
                     event->mtu.value);
+        {
+            conn_ctx_t *c = conn_table_get(event->mtu.conn_handle);
+            if (c) {
+                c->mtu = event->mtu.value;
+            }
+        }
+        return 0;
+
+    case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+        ESP_LOGI(TAG, "phy update; conn_handle=%d status=%d tx_phy=%d rx_phy=%d",
+                    event->phy_updated.conn_handle,
+                    event->phy_updated.status,
+                    event->phy_updated.tx_phy,
+                    event->phy_updated.rx_phy);
+        if (event->phy_updated.status == 0) {
+            conn_ctx_t *c = conn_table_get(event->phy_updated.conn_handle);
+            if (c) {
+                c->tx_phy = event->phy_updated.tx_phy;
+                c->rx_phy = event->phy_updated.rx_phy;
+            }
+        }
+        return 0;
+
+    case BLE_GAP_EVENT_DATA_LEN_CHG:
+        ESP_LOGI(TAG, "data length; conn_handle=%d max_tx=%d max_rx=%d",
+                    event->data_len_chg.conn_handle,
+                    event->data_len_chg.max_tx_octets,
+                    event->data_len_chg.max_rx_octets);
+        {
+            conn_ctx_t *c = conn_table_get(event->data_len_chg.conn_handle);
+            if (c) {
+                c->tx_octets = event->data_len_chg.max_tx_octets;
+                c->rx_octets = event->data_len_chg.max_rx_octets;
+            }
+        }
         return 0;
 
     case BLE_GAP_EVENT_REPEAT_PAIRING:
@@ -484,6 +517,14 @@ bleprph_on_reset(int reason)
     ESP_LOGE(TAG, "Resetting state; reason=%d", reason);
 }
 
+/* What this fan advertises itself as */
+static const fan_ident_t s_fan_ident = {
+    .model = FAN_IDENT_MODEL_WIFI,
+    .caps = FAN_IDENT_CAP_PACKET | FAN_IDENT_CAP_STATUS | FAN_IDENT_CAP_PROFILE |
+            FAN_IDENT_CAP_PRESET | FAN_IDENT_CAP_WIFI,
+    .state_version = FAN_STATUS_VERSION,
+};
+
 static void
 bleprph_on_sync(void)
 {
@@ -510,8 +551,9 @@ bleprph_on_sync(void)
              addr_val[2],
              addr_val[1],
              addr_val[0]);
-    /* Begin advertising. */
-    bleprph_advertise();
+    /* Begin advertising, fast phase first. */
+    fan_adv_init(own_addr_type, &s_fan_ident, bleprph_gap_event);
+    fan_adv_kick();
 }
 
 void bleprph_host_task(void *param)
@@ -543,7 +585,19 @@ void app_main(void)
      *  - will block and wait for BLE provisioning if no credentials exist
      *  - will handle NVS writes and esp_wifi_* calls from its own task context
      */
-    wifi_manager_init();
+    wifi_manager_init(gatt_svr_wifi_state);
+
+    /* Actuator task: applies control state off the NimBLE host task and
+     * reports the applied state back to the status service. */
+    fan_actuator_init(gatt_svr_status_applied);
+
+    /* Presets: load the NVS copy into RAM before any client can recall one */
+    preset_store_init();
+
+    /* Connection parameter policy: idle timer for the per-connection profiles */
+    if (conn_params_init() != 0) {
+        ESP_LOGE(TAG, "conn_params init failed");
+    }
 
     /*
      * NimBLE init. We start NimBLE after wifi_manager_init() so the wifi manager
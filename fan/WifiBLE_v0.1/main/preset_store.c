@@ -0,0 +1,158 @@
+/* preset_store.c
+ * Named presets ("scenes") kept in NVS and mirrored in RAM.
+ *
+ * Reads and recalls are served from the RAM copy. Saves and erases update
+ * RAM immediately and queue the slot number for the writer task, which
+ * persists it; like the Wi-Fi credentials, flash writes never run on the
+ * NimBLE host task.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "nvs.h"
+#include "esp_log.h"
+
+#include "preset_store.h"
+
+static const char *TAG = "preset";
+
+/* NVS namespace; one blob per slot, key "p<slot>" */
+static const char *NVS_NAMESPACE = "presets";
+
+static fan_preset_t s_presets[PRESET_MAX];
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t s_dirty_queue;     /* slot numbers waiting for NVS */
+
+static void preset_key(uint8_t slot, char *key, size_t len)
+{
+    snprintf(key, len, "p%u", slot);
+}
+
+static void load_presets_nvs(void)
+{
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        ESP_LOGI(TAG, "No presets stored yet");
+        return;
+    }
+    for (uint8_t i = 0; i < PRESET_MAX; i++) {
+        char key[8];
+        fan_preset_t p;
+        size_t len = sizeof(p);
+
+        preset_key(i, key, sizeof(key));
+        if (nvs_get_blob(h, key, &p, &len) == ESP_OK && len == sizeof(p) &&
+            p.name_len <= PRESET_NAME_MAX) {
+            p.name[p.name_len] = '\0';
+            s_presets[i] = p;
+        }
+    }
+    nvs_close(h);
+}
+
+/* Write (or erase) one slot as it is now in RAM */
+static esp_err_t store_preset_nvs(uint8_t slot)
+{
+    fan_preset_t p;
+    char key[8];
+    nvs_handle_t h;
+
+    portENTER_CRITICAL(&s_mux);
+    p = s_presets[slot];
+    portEXIT_CRITICAL(&s_mux);
+
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_open failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    preset_key(slot, key, sizeof(key));
+    if (p.used) {
+        err = nvs_set_blob(h, key, &p, sizeof(p));
+    } else {
+        err = nvs_erase_key(h, key);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(h);
+    }
+    nvs_close(h);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "storing preset %u failed: %s", slot, esp_err_to_name(err));
+    }
+    return err;
+}
+
+static void preset_writer_task(void *arg)
+{
+    uint8_t slot;
+
+    for (;;) {
+        if (xQueueReceive(s_dirty_queue, &slot, portMAX_DELAY) == pdTRUE) {
+            store_preset_nvs(slot);
+        }
+    }
+}
+
+static void mark_dirty(uint8_t slot)
+{
+    if (xQueueSend(s_dirty_queue, &slot, 0) != pdTRUE) {
+        /* RAM copy is still right; it is lost only across a reboot */
+        ESP_LOGW(TAG, "preset %u not persisted: writer queue full", slot);
+    }
+}
+
+bool preset_get(uint8_t slot, fan_preset_t *out)
+{
+    if (slot >= PRESET_MAX) {
+        return false;
+    }
+    portENTER_CRITICAL(&s_mux);
+    *out = s_presets[slot];
+    portEXIT_CRITICAL(&s_mux);
+    return out->used;
+}
+
+int preset_save(uint8_t slot, const char *name, uint8_t name_len, const fan_state_t *st)
+{
+    if (slot >= PRESET_MAX || name_len > PRESET_NAME_MAX) {
+        return -1;
+    }
+    portENTER_CRITICAL(&s_mux);
+    fan_preset_t *p = &s_presets[slot];
+    p->used = true;
+    p->name_len = name_len;
+    memcpy(p->name, name, name_len);
+    p->name[name_len] = '\0';
+    p->state = *st;
+    portEXIT_CRITICAL(&s_mux);
+
+    mark_dirty(slot);
+    return 0;
+}
+
+int preset_erase(uint8_t slot)
+{
+    if (slot >= PRESET_MAX) {
+        return -1;
+    }
+    portENTER_CRITICAL(&s_mux);
+    memset(&s_presets[slot], 0, sizeof(s_presets[slot]));
+    portEXIT_CRITICAL(&s_mux);
+
+    mark_dirty(slot);
+    return 0;
+}
+
+/* Called by app_main once at startup */
+void preset_store_init(void)
+{
+    load_presets_nvs();
+    s_dirty_queue = xQueueCreate(PRESET_MAX, sizeof(uint8_t));
+    xTaskCreatePinnedToCore(preset_writer_task, "preset_store", 3072, NULL, 3, NULL, tskNO_AFFINITY);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "fan_actuator.h"   // contains fan_state_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PRESET_MAX          8
+#define PRESET_NAME_MAX     16
+
+/* Preset characteristic opcodes. The first byte of a write is
+ * (op | slot); recall is a single byte so a remote button press is one
+ * short write-without-response.
+ *
+ *     00..07            recall slot
+ *     80..87 [name]     save the current control state to slot, optional name
+ *     40..47            erase slot
+ *
+ * A read returns every used slot as
+ *     slot rpm(le32) angle(le32) light power name_len name...
+ */
+#define PRESET_OP_RECALL    0x00
+#define PRESET_OP_ERASE     0x40
+#define PRESET_OP_SAVE      0x80
+#define PRESET_OP_MASK      0xC0
+#define PRESET_SLOT_MASK    0x3F
+
+typedef struct {
+    bool        used;
+    uint8_t     name_len;
+    char        name[PRESET_NAME_MAX + 1];
+    fan_state_t state;
+} fan_preset_t;
+
+/* Load all presets from NVS into RAM and start the writer task.
+ * Call from app_main() after nvs_flash_init(). */
+void preset_store_init(void);
+
+/* Copy a preset out of the RAM cache. Returns false for an empty slot. */
+bool preset_get(uint8_t slot, fan_preset_t *out);
+
+/* Update the RAM cache at once; the NVS write happens on the writer task
+ * so callers (the NimBLE host) never wait on flash.
+ * Return 0 or -1 for a bad slot / name. */
+int preset_save(uint8_t slot, const char *name, uint8_t name_len, const fan_state_t *st);
+int preset_erase(uint8_t slot);
+
+#ifdef __cplusplus
+}
+#endif
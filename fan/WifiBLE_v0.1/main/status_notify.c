@@ -0,0 +1,334 @@
+/* status_notify.c
+ * Minimum-interval rate limiting for the status notifications.
+ *
+ * ble_gatts_notify() reads the characteristic at send time, so a
+ * change that arrives inside a slot's window only needs a pending flag:
+ * when the window closes the current (latest) value goes out once, however
+ * many changes happened in between. One esp_timer serves all slots and is
+ * always armed for the earliest pending deadline.
+ *
+ * Subscriptions are tracked per connection (in its conn_table entry) from
+ * the GAP subscribe and disconnect events; a change to a slot no connection
+ * has enabled costs one AND and nothing else.
+ *
+ * Each connection then has its own queue. The queue is a bitmap of slots,
+ * so it is bounded by the slot count and collapses repeated changes to the
+ * latest value (the value is read when the PDU is built).
+ *
+ * There is no per-connection in-flight count: NimBLE raises NOTIFY_TX from
+ * inside ble_gatts_notify(), when the PDU is queued rather than sent, so a
+ * credit returned on it never holds anything back. What a congested link
+ * can do is fill the shared msys pool with PDUs the controller cannot send
+ * yet. So notifications stop while the pool is down to
+ * CONFIG_FAN_NOTIFY_MSYS_RESERVE free blocks, leaving those to writes,
+ * responses and the other links; whatever is queued then, or refused by
+ * the host, stays queued and is retried from the timer.
+ */
+#include <stdbool.h>
+
+#include "host/ble_hs.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "status_notify.h"
+#include "conn_table.h"
+
+static const char *TAG = "status_ntf";
+
+#define NO_DEADLINE INT64_MAX
+
+typedef struct {
+    const uint16_t *val_handle;
+    int (*encode)(uint16_t conn_handle, struct os_mbuf *om);
+    int64_t min_us;
+    int64_t last_us;        /* time of the last notification */
+    bool    pending;
+} notify_slot_t;
+
+static notify_slot_t s_slots[STATUS_NOTIFY_MAX_SLOTS];
+static int s_count;
+
+/* Retry delay for a notification the host refused (out of buffers) */
+#define NOTIFY_RETRY_US (20 * 1000)
+
+/* The per-connection subscriptions and queue live in the
+ * connection's conn_table entry and are only touched under s_mux. */
+static uint32_t s_subscribed;               /* OR of every entry's subs */
+
+static esp_timer_handle_t s_timer;
+static int64_t s_armed_at = NO_DEADLINE;     /* deadline the timer is set for */
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* Under s_mux: take every pending slot whose window has closed and return
+ * them as a mask; *next is set to the earliest deadline still pending. */
+static uint32_t collect_due(int64_t now, int64_t *next)
+{
+    uint32_t due = 0;
+
+    *next = NO_DEADLINE;
+    for (int i = 0; i < s_count; i++) {
+        notify_slot_t *s = &s_slots[i];
+        if (!s->pending) {
+            continue;
+        }
+        int64_t at = s->last_us + s->min_us;
+        if (now >= at) {
+            s->pending = false;
+            s->last_us = now;
+            due |= 1u << i;
+        } else if (at < *next) {
+            *next = at;
+        }
+    }
+    return due;
+}
+
+/* Under s_mux: should the timer be (re)armed for `next`? */
+static bool need_arm(int64_t next)
+{
+    if (next == NO_DEADLINE || next >= s_armed_at) {
+        return false;
+    }
+    s_armed_at = next;
+    return true;
+}
+
+/* the PDU was not built (no buffer, or the pool is at its reserve); the
+ * host never saw it */
+#define NOTIFY_NOT_SENT (-1)
+
+/* Send one slot to one connection. Slots with an encoder get a value built
+ * for that connection. */
+static int notify_one(uint16_t conn_handle, const notify_slot_t *s)
+{
+    if (s->encode == NULL) {
+        return ble_gatts_notify(conn_handle, *s->val_handle);
+    }
+
+    struct os_mbuf *om = ble_hs_mbuf_att_pkt();
+    if (om == NULL) {
+        return NOTIFY_NOT_SENT;
+    }
+    if (s->encode(conn_handle, om) != 0) {
+        os_mbuf_free_chain(om);
+        return NOTIFY_NOT_SENT;
+    }
+    /* consumes om whatever the outcome */
+    return ble_gatts_notify_custom(conn_handle, *s->val_handle, om);
+}
+
+/* Send the queued slots to one connection. Returns true if the pool is at
+ * its reserve or the host refused a notification, and the slot has to be
+ * retried later. If another task is
+ * already sending for this entry, it picks up what was just queued. */
+static bool pump(conn_ctx_t *c)
+{
+    bool retry = false;
+
+    portENTER_CRITICAL(&s_mux);
+    if (c->busy) {
+        portEXIT_CRITICAL(&s_mux);
+        return false;
+    }
+    c->busy = true;
+    while (c->queued != 0) {
+        int slot = __builtin_ctz(c->queued);
+        uint32_t bit = 1u << slot;
+        uint16_t conn_handle = c->conn_handle;
+
+        c->queued &= ~bit;
+        portEXIT_CRITICAL(&s_mux);
+
+        int rc = NOTIFY_NOT_SENT;
+        if (os_msys_num_free() > CONFIG_FAN_NOTIFY_MSYS_RESERVE) {
+            rc = notify_one(conn_handle, &s_slots[slot]);
+        }
+
+        portENTER_CRITICAL(&s_mux);
+        if (rc != 0) {
+            /* keep the slot queued for the retry */
+            if (c->conn_handle == conn_handle) {
+                c->queued |= bit & c->subs;
+            }
+            retry = c->queued != 0;
+            break;
+        }
+    }
+    c->busy = false;
+    portEXIT_CRITICAL(&s_mux);
+    return retry;
+}
+
+/* Queue the `due` slots on every subscribed connection, send them and
+ * (re)arm the timer for `next` or for a retry. */
+static void flush_and_arm(uint32_t due, int64_t next, int64_t now)
+{
+    bool retry = false;
+
+    if (due) {
+        portENTER_CRITICAL(&s_mux);
+        for (int i = 0; i < CONN_TABLE_MAX; i++) {
+            conn_ctx_t *c = conn_table_at(i);
+            if (c) {
+                c->queued |= due & c->subs;
+            }
+        }
+        portEXIT_CRITICAL(&s_mux);
+    }
+    for (int i = 0; i < CONN_TABLE_MAX; i++) {
+        conn_ctx_t *c = conn_table_at(i);
+        if (c && c->queued) {
+            retry |= pump(c);
+        }
+    }
+    if (retry && now + NOTIFY_RETRY_US < next) {
+        next = now + NOTIFY_RETRY_US;
+    }
+
+    portENTER_CRITICAL(&s_mux);
+    bool arm = need_arm(next);
+    portEXIT_CRITICAL(&s_mux);
+
+    if (arm) {
+        esp_timer_stop(s_timer);    /* may already be idle */
+        esp_timer_start_once(s_timer, (uint64_t)(next - now));
+    }
+}
+
+static void notify_timer_cb(void *arg)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t next;
+
+    portENTER_CRITICAL(&s_mux);
+    s_armed_at = NO_DEADLINE;
+    uint32_t due = collect_due(now, &next);
+    portEXIT_CRITICAL(&s_mux);
+
+    flush_and_arm(due, next, now);
+}
+
+void status_notify_mark(uint32_t slot_mask)
+{
+    int64_t now;
+    int64_t next;
+
+    if ((slot_mask & s_subscribed) == 0) {
+        return;     /* nobody listening: no timer, no lock, no GATT work */
+    }
+    now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_mux);
+    slot_mask &= s_subscribed;
+    for (int i = 0; i < s_count; i++) {
+        if (slot_mask & (1u << i)) {
+            s_slots[i].pending = true;
+        }
+    }
+    uint32_t due = collect_due(now, &next);
+    portEXIT_CRITICAL(&s_mux);
+
+    flush_and_arm(due, next, now);
+}
+
+void status_notify_conn_mark(uint16_t conn_handle, uint32_t slot_mask)
+{
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    bool found = false;
+
+    if (c == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&s_mux);
+    c->queued |= slot_mask & c->subs;
+    found = c->queued != 0;
+    portEXIT_CRITICAL(&s_mux);
+
+    if (found) {
+        flush_and_arm(0, NO_DEADLINE, esp_timer_get_time());
+    }
+}
+
+/* Under s_mux */
+static void recompute_subscribed(void)
+{
+    uint32_t all = 0;
+    for (int i = 0; i < CONN_TABLE_MAX; i++) {
+        conn_ctx_t *c = conn_table_at(i);
+        if (c) {
+            all |= c->subs;
+        }
+    }
+    s_subscribed = all;
+}
+
+void status_notify_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify)
+{
+    int slot = -1;
+    for (int i = 0; i < s_count; i++) {
+        if (*s_slots[i].val_handle == attr_handle) {
+            slot = i;
+            break;
+        }
+    }
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    if (slot < 0 || c == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&s_mux);
+    if (notify) {
+        if (c->subs == 0) {
+            c->queued = 0;
+        }
+        c->subs |= 1u << slot;
+    } else {
+        c->subs &= ~(1u << slot);
+        c->queued &= ~(1u << slot);
+    }
+    recompute_subscribed();
+    portEXIT_CRITICAL(&s_mux);
+}
+
+void status_notify_conn_closed(uint16_t conn_handle)
+{
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    if (c == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&s_mux);
+    c->subs = 0;
+    c->queued = 0;
+    recompute_subscribed();
+    portEXIT_CRITICAL(&s_mux);
+}
+
+uint32_t status_notify_subscribed(void)
+{
+    return s_subscribed;
+}
+
+int status_notify_init(const status_notify_cfg_t *cfg, int count)
+{
+    if (count > STATUS_NOTIFY_MAX_SLOTS) {
+        ESP_LOGE(TAG, "too many notify slots (%d)", count);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        s_slots[i].val_handle = cfg[i].val_handle;
+        s_slots[i].encode = cfg[i].encode;
+        s_slots[i].min_us = (int64_t)cfg[i].min_interval_ms * 1000;
+        s_slots[i].last_us = -s_slots[i].min_us;    /* first change goes out at once */
+        s_slots[i].pending = false;
+    }
+    s_count = count;
+
+    const esp_timer_create_args_t args = {
+        .callback = notify_timer_cb,
+        .name = "status_ntf",
+    };
+    return esp_timer_create(&args, &s_timer) == ESP_OK ? 0 : -1;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATUS_NOTIFY_MAX_SLOTS 8
+
+struct os_mbuf;
+
+/* One rate-limited notify characteristic */
+typedef struct {
+    const uint16_t *val_handle;     /* filled in when the service registers */
+    uint32_t min_interval_ms;       /* 0 = notify immediately */
+    /* Optional: build the value for one connection (per-client fields).
+     * NULL reads the characteristic as ble_gatts_notify() does. */
+    int (*encode)(uint16_t conn_handle, struct os_mbuf *om);
+} status_notify_cfg_t;
+
+/* Set up the slots and the flush timer. `cfg` is copied. */
+int status_notify_init(const status_notify_cfg_t *cfg, int count);
+
+/* The values behind the slots in `slot_mask` (bit i = cfg[i]) changed.
+ * Slots nobody is subscribed to are dropped right here. A slot outside its
+ * window is queued at once on every subscribed connection; otherwise the
+ * change is merged with any pending one and the latest value is queued when
+ * the window expires. Nothing is sent while the msys pool is down to its
+ * reserve; what is held back or refused is retried later. Callable from any task. */
+void status_notify_mark(uint32_t slot_mask);
+
+/* Queue the slots in `slot_mask` for one connection right away, outside
+ * the rate limit, if it is subscribed to them. Used to deliver a reply
+ * (e.g. an ack) that only concerns that connection. */
+void status_notify_conn_mark(uint16_t conn_handle, uint32_t slot_mask);
+
+/* Track CCCD changes (BLE_GAP_EVENT_SUBSCRIBE) and dropped connections.
+ * The state is kept in the connection's conn_table entry, so call
+ * conn_closed before the entry is removed. Attribute handles that are not
+ * a slot are ignored. */
+void status_notify_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
+void status_notify_conn_closed(uint16_t conn_handle);
+
+/* Mask of slots at least one connection is subscribed to */
+uint32_t status_notify_subscribed(void);
+
+#ifdef __cplusplus
+}
+#endif
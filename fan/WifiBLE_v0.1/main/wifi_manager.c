@@ -1,4 +1,5 @@
 #include "wifi_cred.h"
+#include "wifi_manager.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
@@ -8,6 +9,10 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "sdkconfig.h"
+#include <stdbool.h>
 #include <string.h>
 
 
@@ -18,17 +23,38 @@ static const char *TAG = "wifi_mgr";
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 
-
+#define WIFI_CRED_QUEUE_LEN 2
+#define WIFI_EVT_QUEUE_LEN  8
 
 /* Exported queue handle so BLE code can post credentials */
 QueueHandle_t wifi_cred_queue;
 EventGroupHandle_t wifi_event_group;
 
+/* Station events, forwarded by the event handler to wifi_manager_task */
+typedef struct {
+    uint8_t type;       /* WIFI_MGR_EVT_* */
+    uint8_t reason;     /* wifi_err_reason_t, for WIFI_MGR_EVT_DISCONNECTED */
+} wifi_mgr_evt_t;
+
+#define WIFI_MGR_EVT_DISCONNECTED 0
+#define WIFI_MGR_EVT_GOT_IP       1
+
+static QueueHandle_t s_evt_queue;
+static QueueSetHandle_t s_queue_set;    /* s_evt_queue and wifi_cred_queue */
+
+/* Reconnect state, only touched by wifi_manager_task */
+static uint32_t s_attempts;             /* failed attempts since the last connection */
+static int64_t s_retry_at;              /* esp_timer time of the next attempt; 0 = none */
+static bool s_leaving;                  /* our esp_wifi_disconnect() is yet to report */
+
 /* NVS namespace & keys */
 static const char *NVS_NAMESPACE = "wifi";
 static const char *NVS_KEY_SSID = "ssid";
 static const char *NVS_KEY_PASS = "pass";
 
+static wifi_mgr_state_t s_state = WIFI_MGR_IDLE;
+static wifi_manager_state_cb_t s_state_cb;
+
 /* forward */
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data);
@@ -86,6 +112,125 @@ static esp_err_t load_credentials_nvs(wifi_credentials_t *out)
     return ESP_OK;
 }
 
+static void set_state(wifi_mgr_state_t state)
+{
+    if (s_state == state) {
+        return;
+    }
+    s_state = state;
+    if (s_state_cb) {
+        s_state_cb(state);
+    }
+}
+
+wifi_mgr_state_t wifi_manager_state(void)
+{
+    return s_state;
+}
+
+/*
+ * Reconnects. Every connect attempt scans for the AP, and the radio is
+ * shared with BLE, so failures must not turn into a hot loop that starves
+ * the advertising and the connections. Failed attempts back off
+ * exponentially from CONFIG_WIFI_RETRY_MIN_MS up to CONFIG_WIFI_RETRY_MAX_MS
+ * and keep going at that pace, so the fan comes back on its own after an
+ * AP reboot. The upper half of each delay is random, so fans behind the same
+ * AP do not retry in lockstep. A link that was up and dropped for a
+ * transient reason (a roam, missed beacons) gets one retry after
+ * CONFIG_WIFI_RETRY_FAST_MS first: the AP, or a neighbour, is most likely
+ * still there.
+ */
+
+/* Delay before the next attempt after `attempts` earlier failures */
+static uint32_t backoff_ms(uint32_t attempts)
+{
+    uint32_t ms = CONFIG_WIFI_RETRY_MAX_MS;
+
+    if (attempts < 16 && ((uint32_t)CONFIG_WIFI_RETRY_MIN_MS << attempts) < ms) {
+        ms = (uint32_t)CONFIG_WIFI_RETRY_MIN_MS << attempts;
+    }
+    return ms / 2 + esp_random() % (ms / 2 + 1);
+}
+
+/* Is the loss of an established link worth a quick retry? */
+static bool drop_is_transient(uint8_t reason)
+{
+    switch (reason) {
+    case WIFI_REASON_ROAMING:
+    case WIFI_REASON_BEACON_TIMEOUT:
+    case WIFI_REASON_AUTH_EXPIRE:
+    case WIFI_REASON_DISASSOC_DUE_TO_INACTIVITY:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void schedule_retry(uint32_t delay_ms)
+{
+    s_retry_at = esp_timer_get_time() + (int64_t)delay_ms * 1000;
+    ESP_LOGI(TAG, "Reconnecting in %lu ms (failed attempts: %lu)",
+             (unsigned long)delay_ms, (unsigned long)s_attempts);
+}
+
+static void connect_now(void)
+{
+    s_retry_at = 0;
+    set_state(WIFI_MGR_CONNECTING);
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_wifi_connect failed: %s", esp_err_to_name(err));
+        set_state(WIFI_MGR_DISCONNECTED);
+        schedule_retry(backoff_ms(s_attempts++));
+    }
+}
+
+/* One station event, in wifi_manager_task */
+static void handle_event(const wifi_mgr_evt_t *evt)
+{
+    uint32_t delay_ms;
+
+    if (evt->type == WIFI_MGR_EVT_GOT_IP) {
+        if (s_attempts != 0) {
+            ESP_LOGI(TAG, "Connected after %lu failed attempts", (unsigned long)s_attempts);
+        }
+        s_attempts = 0;
+        s_retry_at = 0;
+        s_leaving = false;
+        xEventGroupClearBits(wifi_event_group, WIFI_FAIL_BIT);
+        xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        set_state(WIFI_MGR_CONNECTED);
+        return;
+    }
+
+    /* The one ASSOC_LEAVE our own esp_wifi_disconnect() causes is expected;
+     * an AP going down sends the same reason and is retried like any drop.
+     * The leave reports first if at all, so the flag only covers the next
+     * disconnect, whatever its reason. Anything outside an attempt or a
+     * connection has nothing to retry. */
+    if (s_leaving) {
+        s_leaving = false;
+        if (evt->reason == WIFI_REASON_ASSOC_LEAVE) {
+            return;
+        }
+    }
+    if (s_state != WIFI_MGR_CONNECTING && s_state != WIFI_MGR_CONNECTED) {
+        return;
+    }
+    xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+    xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
+
+    if (s_state == WIFI_MGR_CONNECTED && drop_is_transient(evt->reason)) {
+        ESP_LOGW(TAG, "Link lost (reason %u), retrying fast", evt->reason);
+        delay_ms = CONFIG_WIFI_RETRY_FAST_MS;
+    } else {
+        ESP_LOGW(TAG, "Connection failed (reason %u)", evt->reason);
+        delay_ms = backoff_ms(s_attempts++);
+    }
+    set_state(WIFI_MGR_DISCONNECTED);
+    schedule_retry(delay_ms);
+}
+
 /* Wi-Fi config + start function (task context) */
 static esp_err_t wifi_start_with_creds(const wifi_credentials_t *cred)
 {
@@ -96,6 +241,13 @@ static esp_err_t wifi_start_with_creds(const wifi_credentials_t *cred)
 
     ESP_LOGI(TAG, "Setting Wi-Fi config SSID='%s' (len=%u)", cred->ssid, cred->ssid_len);
 
+    if (s_state != WIFI_MGR_IDLE) {
+        /* new credentials: leave the current AP, if any, and start over. Only
+         * a link or an attempt in progress reports the leave. */
+        s_leaving = s_state == WIFI_MGR_CONNECTING || s_state == WIFI_MGR_CONNECTED;
+        esp_wifi_disconnect();
+    }
+
     esp_err_t err = esp_wifi_set_mode(WIFI_MODE_STA);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_wifi_set_mode failed: %s", esp_err_to_name(err));
@@ -111,21 +263,46 @@ static esp_err_t wifi_start_with_creds(const wifi_credentials_t *cred)
         ESP_LOGE(TAG, "esp_wifi_start failed: %s", esp_err_to_name(err));
         return err;
     }
-    err = esp_wifi_connect();
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_wifi_connect failed: %s", esp_err_to_name(err));
-        return err;
-    }
-    ESP_LOGI(TAG, "Wi-Fi connection initiated");
+    s_attempts = 0;
+    connect_now();
     ESP_LOGI(TAG, "Wi-Fi start requested");
     return ESP_OK;
 }
 
-/* This task owns Wi-Fi init/connect and NVS writes */
+/* Credentials from BLE: validate, store and connect with them */
+static void handle_cred(const wifi_credentials_t *cred)
+{
+    esp_err_t err;
+
+    ESP_LOGI(TAG, "Got credentials from BLE: ssid_len=%u pass_len=%u", cred->ssid_len, cred->pass_len);
+
+    // Validate lengths
+    if (cred->ssid_len == 0 || cred->ssid_len > WIFI_SSID_MAX_LEN ||
+        cred->pass_len > WIFI_PASS_MAX_LEN) {
+        ESP_LOGW(TAG, "Invalid credential lengths, ignoring.");
+        return;
+    }
+
+    // Store to NVS
+    err = store_credentials_nvs(cred->ssid, cred->pass);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store credentials");
+        return;
+    }
+
+    // Start Wi-Fi with new config
+    err = wifi_start_with_creds(cred);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start Wi-Fi: %s", esp_err_to_name(err));
+    }
+}
+
+/* This task owns Wi-Fi init/connect, the reconnect state machine and NVS
+ * writes. It sleeps until credentials, a station event or the next retry. */
 static void wifi_manager_task(void *arg)
 {
     wifi_credentials_t cred;
-    esp_err_t err;
+    wifi_mgr_evt_t evt;
 
     /* Ensure NVS and esp-event/wifi are initialised */
     // nvs_flash_init should have been called in app_main already
@@ -153,34 +330,25 @@ static void wifi_manager_task(void *arg)
     }
 
     for (;;) {
-        /* Wait for a credential message from BLE (blocking) */
-        if (xQueueReceive(wifi_cred_queue, &cred, portMAX_DELAY) == pdTRUE) {
-            ESP_LOGI(TAG, "Got credentials from BLE: ssid_len=%u pass_len=%u", cred.ssid_len, cred.pass_len);
-
-            // Validate lengths
-            if (cred.ssid_len == 0 || cred.ssid_len > WIFI_SSID_MAX_LEN ||
-                cred.pass_len > WIFI_PASS_MAX_LEN) {
-                ESP_LOGW(TAG, "Invalid credential lengths, ignoring.");
-                continue;
-            }
-
-            // Store to NVS
-            err = store_credentials_nvs(cred.ssid, cred.pass);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to store credentials");
-                continue;
-            }
+        TickType_t wait = portMAX_DELAY;
 
-            // Start Wi-Fi with new config
-            err = wifi_start_with_creds(&cred);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to start Wi-Fi: %s", esp_err_to_name(err));
-                continue;
-            }
+        if (s_retry_at != 0) {
+            int64_t left_us = s_retry_at - esp_timer_get_time();
+            wait = left_us > 0 ? pdMS_TO_TICKS(left_us / 1000) + 1 : 0;
+        }
 
-            // Optionally block here until connection or failure if you want to wait.
-            // But typically you let event handler set wifi_event_group bits.
+        QueueSetMemberHandle_t ready = xQueueSelectFromSet(s_queue_set, wait);
+        if (ready == s_evt_queue && xQueueReceive(s_evt_queue, &evt, 0) == pdTRUE) {
+            handle_event(&evt);
+        } else if (ready == wifi_cred_queue &&
+                   xQueueReceive(wifi_cred_queue, &cred, 0) == pdTRUE) {
+            handle_cred(&cred);
+        }
 
+        if (s_retry_at != 0 && esp_timer_get_time() >= s_retry_at) {
+            /* a retry follows a reported disconnect; no leave is pending */
+            s_leaving = false;
+            connect_now();
         }
     }
 }
@@ -189,15 +357,25 @@ static void wifi_manager_task(void *arg)
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                                int32_t event_id, void* event_data)
 {
+    wifi_mgr_evt_t evt = { 0 };
+
+    /* the state machine runs in wifi_manager_task; just forward */
     if (event_base == WIFI_EVENT) {
         if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
-            // You may want to implement retry logic here (example earlier had retry)
-            xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
-            ESP_LOGI(TAG, "WIFI_EVENT_STA_DISCONNECTED");
+            wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *) event_data;
+            ESP_LOGI(TAG, "WIFI_EVENT_STA_DISCONNECTED reason=%u", event->reason);
+            evt.type = WIFI_MGR_EVT_DISCONNECTED;
+            evt.reason = event->reason;
+            if (xQueueSend(s_evt_queue, &evt, 0) != pdTRUE) {
+                ESP_LOGW(TAG, "event queue full, disconnect dropped");
+            }
         }
     } else if (event_base == IP_EVENT) {
         if (event_id == IP_EVENT_STA_GOT_IP) {
-            xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+            evt.type = WIFI_MGR_EVT_GOT_IP;
+            if (xQueueSend(s_evt_queue, &evt, 0) != pdTRUE) {
+                ESP_LOGW(TAG, "event queue full, got IP dropped");
+            }
             ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
             ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
             do_ping_cmd();
@@ -206,10 +384,17 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
 }
 
 /* Called by app_main once at startup */
-void wifi_manager_init(void)
+void wifi_manager_init(wifi_manager_state_cb_t state_cb)
 {
+    s_state_cb = state_cb;
     // create the credentials queue: holds wifi_credentials_t objects
-    wifi_cred_queue = xQueueCreate(2, sizeof(wifi_credentials_t));
+    wifi_cred_queue = xQueueCreate(WIFI_CRED_QUEUE_LEN, sizeof(wifi_credentials_t));
+    // station events for the reconnect state machine
+    s_evt_queue = xQueueCreate(WIFI_EVT_QUEUE_LEN, sizeof(wifi_mgr_evt_t));
+    // the task waits on both; they must still be empty when added
+    s_queue_set = xQueueCreateSet(WIFI_CRED_QUEUE_LEN + WIFI_EVT_QUEUE_LEN);
+    xQueueAddToSet(wifi_cred_queue, s_queue_set);
+    xQueueAddToSet(s_evt_queue, s_queue_set);
     // create the manager task
     xTaskCreatePinnedToCore(wifi_manager_task, "wifi_manager", 4096, NULL, 5, NULL, tskNO_AFFINITY);
 }
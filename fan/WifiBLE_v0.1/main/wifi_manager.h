@@ -8,8 +8,25 @@
 extern "C" {
 #endif
 
-/* Create and start the wifi manager task and queue. Call from app_main(). */
-void wifi_manager_init(void);
+/* Station connection state */
+typedef enum {
+    WIFI_MGR_IDLE,          /* no credentials yet */
+    WIFI_MGR_CONNECTING,
+    WIFI_MGR_CONNECTED,     /* got an IP address */
+    WIFI_MGR_DISCONNECTED,
+} wifi_mgr_state_t;
+
+/* Called from the wifi manager task whenever the state changes. After a
+ * failure the state is WIFI_MGR_DISCONNECTED until the next attempt, which
+ * the manager schedules itself with backoff; see wifi_manager.c. */
+typedef void (*wifi_manager_state_cb_t)(wifi_mgr_state_t state);
+
+/* Create and start the wifi manager task and queue. Call from app_main().
+ * `state_cb` may be NULL. */
+void wifi_manager_init(wifi_manager_state_cb_t state_cb);
+
+/* Current station state */
+wifi_mgr_state_t wifi_manager_state(void);
 
 /* The Wi-Fi manager creates this queue handle; gatt_svr.c references it as extern. */
 extern QueueHandle_t wifi_cred_queue;
@@ -42,11 +42,12 @@ struct ble_gatt_register_ctxt;
 void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
 int gatt_svr_init(void);
 
-/* Connection tracking exposed from gatt_svr.c */
-int add_connection_handle(uint16_t conn_handle);
-void remove_connection_handle(uint16_t conn_handle);
-int count_active_connections(void);
-int get_connection_index(uint16_t conn_handle);
+/* Subscription tracking, fed from BLE_GAP_EVENT_SUBSCRIBE / NOTIFY_TX /
+ * DISCONNECT. Connections are tracked in conn_table; on_disconnect runs
+ * before the entry is removed. */
+void gatt_svr_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
+void gatt_svr_on_notify_tx(uint16_t conn_handle, uint16_t attr_handle, int status);
+void gatt_svr_on_disconnect(uint16_t conn_handle);
 
 #ifdef __cplusplus
 }
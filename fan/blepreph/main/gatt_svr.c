@@ -22,15 +22,14 @@
 #include <string.h>
 #include "host/ble_hs.h"
 #include "host/ble_uuid.h"
+#include "nimble/nimble_port.h"
 #include "services/gap/ble_svc_gap.h"
 #include "services/gatt/ble_svc_gatt.h"
 #include "bleprph.h"
+#include "conn_table.h"
+#include "fan_adv.h"
 //#include "services/ans/ble_svc_ans.h"
 
-/*** Maximum number of characteristics with the notify flag ***/
-
-#define MAX_CONNECTIONS 2
-
 
 
 
@@ -47,48 +46,29 @@ static uint16_t stat_power_handle;
 
 
 
-// Array to store up to two connection handles
-static uint16_t conn_handles[MAX_CONNECTIONS] = {BLE_HS_CONN_HANDLE_NONE, BLE_HS_CONN_HANDLE_NONE};
-
-// Utility to add a connection handle
-int add_connection_handle(uint16_t conn_handle) {
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (conn_handles[i] == BLE_HS_CONN_HANDLE_NONE) {
-            conn_handles[i] = conn_handle;
-            return i;
-        }
-    }
-    return -1; // No space
-}
-
-// Utility to remove a connection handle
-void remove_connection_handle(uint16_t conn_handle) {
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (conn_handles[i] == conn_handle) {
-            conn_handles[i] = BLE_HS_CONN_HANDLE_NONE;
-        }
-    }
-}
-
-// Utility to count active connections
-int count_active_connections(void) {
-    int count = 0;
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (conn_handles[i] != BLE_HS_CONN_HANDLE_NONE) {
-            count++;
-        }
-    }
-    return count;
-}
-
-// Utility to get index by connection handle
-int get_connection_index(uint16_t conn_handle) {
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (conn_handles[i] == conn_handle) {
-            return i;
+// Status characteristics each connection has notifications enabled for
+// (conn_ctx_t.subs)
+#define STAT_SUB_RPM    (1u << 0)
+#define STAT_SUB_ANGLE  (1u << 1)
+#define STAT_SUB_LIGHT  (1u << 2)
+#define STAT_SUB_POWER  (1u << 3)
+static uint8_t all_subs;        // OR of every connection's subs, checked on every update
+
+// Per-connection notify queue, kept in the conn_table entry. The queue holds
+// at most one entry per characteristic (the value is read when the PDU is
+// built, so repeated changes collapse to the latest one). Nothing is sent
+// while the msys pool is down to CONFIG_FAN_NOTIFY_MSYS_RESERVE free blocks,
+// so a link that stops draining cannot starve the others; what is held back
+// or refused by the host stays queued and is retried from a callout.
+static void recompute_subs(void) {
+    uint8_t all = 0;
+    for (int i = 0; i < CONN_TABLE_MAX; i++) {
+        conn_ctx_t *c = conn_table_at(i);
+        if (c) {
+            all |= c->subs;
         }
     }
-    return -1;
+    all_subs = all;
 }
 
 
@@ -127,31 +107,157 @@ static inline uint32_t current_stat_angle(void) { return g_stat_angle; }
 static inline uint8_t  current_stat_light(void) { return g_stat_light; }
 static inline uint8_t  current_stat_power(void) { return g_stat_power; }
 
+// Track a CCCD change on one of the status characteristics
+void gatt_svr_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify) {
+    uint8_t bit;
+    if (attr_handle == stat_rpm_handle)        bit = STAT_SUB_RPM;
+    else if (attr_handle == stat_angle_handle) bit = STAT_SUB_ANGLE;
+    else if (attr_handle == stat_light_handle) bit = STAT_SUB_LIGHT;
+    else if (attr_handle == stat_power_handle) bit = STAT_SUB_POWER;
+    else return;
+
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    if (c == NULL) {
+        return;
+    }
+    if (notify) {
+        if (c->subs == 0) {
+            c->queued = 0;
+        }
+        c->subs |= bit;
+    } else {
+        c->subs &= ~bit;
+        c->queued &= ~bit;
+    }
+    recompute_subs();
+}
+
+// The connection is going away (still in conn_table)
+void gatt_svr_on_disconnect(uint16_t conn_handle) {
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    if (c) {
+        c->subs = 0;
+        c->queued = 0;
+        recompute_subs();
+    }
+}
+
+// Value handle behind each STAT_SUB_* bit
+static uint16_t *const stat_sub_handles[] = {
+    &stat_rpm_handle, &stat_angle_handle, &stat_light_handle, &stat_power_handle,
+};
+
+// Retry delay for a notification the host refused (out of buffers). The
+// callout runs on the host task, like every other caller of stat_pump().
+#define NOTIFY_RETRY_MS 20
+static struct ble_npl_callout notify_retry;
+
+// Send what is queued for one connection. `busy` keeps a change made while
+// ble_gatts_notify() runs (e.g. from a nested GAP event) from starting a
+// second loop on the same entry; this one sends whatever it queued.
+static void stat_pump(conn_ctx_t *c)
+{
+    if (c->busy) {
+        return;
+    }
+    c->busy = true;
+    while (c->queued != 0) {
+        int n = __builtin_ctz(c->queued);
+        uint8_t bit = 1u << n;
+
+        c->queued &= ~bit;
+        if (os_msys_num_free() <= CONFIG_FAN_NOTIFY_MSYS_RESERVE ||
+            ble_gatts_notify(c->conn_handle, *stat_sub_handles[n]) != 0) {
+            // Pool at its reserve or out of buffers: keep it queued and
+            // try again shortly
+            c->queued |= bit & c->subs;
+            if (c->queued && !ble_npl_callout_is_active(&notify_retry)) {
+                ble_npl_callout_reset(&notify_retry,
+                                      ble_npl_time_ms_to_ticks32(NOTIFY_RETRY_MS));
+            }
+            break;
+        }
+    }
+    c->busy = false;
+}
+
+static void notify_retry_cb(struct ble_npl_event *ev)
+{
+    for (int i = 0; i < CONN_TABLE_MAX; i++) {
+        conn_ctx_t *c = conn_table_at(i);
+        if (c && c->queued) {
+            stat_pump(c);
+        }
+    }
+}
+
+// BLE_GAP_EVENT_NOTIFY_TX for a notification
+void gatt_svr_on_notify_tx(uint16_t conn_handle, uint16_t attr_handle, int status) {
+    conn_ctx_t *c = conn_table_get(conn_handle);
+    if (c == NULL) {
+        return;
+    }
+    if (status == 0) {
+        c->stats.tx_notify++;
+    } else {
+        c->stats.tx_fail++;
+    }
+}
+
+// Show the current status in the advertising beacon (no Wi-Fi on this fan)
+static void stat_beacon(void)
+{
+    fan_beacon_t b = {
+        .power = g_stat_power,
+        .light = g_stat_light,
+        .wifi  = FAN_BEACON_WIFI_NONE,
+        .rpm   = g_stat_rpm,
+        .angle = g_stat_angle,
+    };
+    fan_adv_set_beacon(&b);
+}
+
+// Queue the change on every subscribed connection; skip that if nobody is.
+// The beacon is refreshed by the caller once the whole write is applied.
+static inline void stat_notify(uint8_t bit)
+{
+    if ((all_subs & bit) == 0) {
+        return;
+    }
+    for (int i = 0; i < CONN_TABLE_MAX; i++) {
+        conn_ctx_t *c = conn_table_at(i);
+        if (c && (c->subs & bit)) {
+            c->queued |= bit;
+            stat_pump(c);
+        }
+    }
+}
+
 /* --- Simple "scheduler" stubs. In real code, post work to a task. --- */
 static void schedule_set_rpm(uint32_t rpm)
 {
     /* For demo: apply immediately and update status + notify subscribers */
     g_stat_rpm = rpm;
     /* stat_rpm_handle must be defined earlier in your file */
-    ble_gatts_chr_updated(stat_rpm_handle);
+    stat_notify(STAT_SUB_RPM);
 }
 
 static void schedule_set_angle(uint32_t angle)
 {
     g_stat_angle = angle;
-    ble_gatts_chr_updated(stat_angle_handle);
+    stat_notify(STAT_SUB_ANGLE);
 }
 
 static void schedule_set_light(uint8_t light)
 {
     g_stat_light = light;
-    ble_gatts_chr_updated(stat_light_handle);
+    stat_notify(STAT_SUB_LIGHT);
 }
 
 static void schedule_set_power(uint8_t power)
 {
     g_stat_power = power;
-    ble_gatts_chr_updated(stat_power_handle);
+    stat_notify(STAT_SUB_POWER);
 }
 
 
@@ -381,6 +487,7 @@ gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle,
         return BLE_ATT_ERR_UNLIKELY;
 
     case BLE_GATT_ACCESS_OP_WRITE_CHR:
+        conn_table_touch(conn_handle);
         if (attr_handle == ctrl_rpm_handle) {
             /* expect 4 bytes uint32_t */
             rc = gatt_svr_write(ctxt->om, sizeof(uint32_t), sizeof(uint32_t), &g_ctrl_rpm, NULL);
@@ -388,26 +495,24 @@ gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle,
                 /* schedule hardware action; notify on completion */
                 schedule_set_rpm(g_ctrl_rpm);
             }
-            return rc;
-        }
-        if (attr_handle == ctrl_angle_handle) {
+        } else if (attr_handle == ctrl_angle_handle) {
             rc = gatt_svr_write(ctxt->om, sizeof(uint32_t), sizeof(uint32_t), &g_ctrl_angle, NULL);
             if (rc == 0) schedule_set_angle(g_ctrl_angle);
-            return rc;
-        }
-        if (attr_handle == ctrl_light_handle) {
+        } else if (attr_handle == ctrl_light_handle) {
             rc = gatt_svr_write(ctxt->om, sizeof(uint8_t), sizeof(uint8_t), &g_ctrl_light, NULL);
             if (rc == 0) schedule_set_light(g_ctrl_light);
-            return rc;
-        }
-        if (attr_handle == ctrl_power_handle) {
+        } else if (attr_handle == ctrl_power_handle) {
             rc = gatt_svr_write(ctxt->om, sizeof(uint8_t), sizeof(uint8_t), &g_ctrl_power, NULL);
             if (rc == 0) schedule_set_power(g_ctrl_power);
-            return rc;
+        } else {
+            /* Writes to status chars are not permitted */
+            return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
         }
-
-        /* Writes to status chars are not permitted */
-        return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+        if (rc == 0) {
+            /* every field of the write is set: one beacon update for all */
+            stat_beacon();
+        }
+        return rc;
 
     case BLE_GATT_ACCESS_OP_READ_DSC:
         /* If you have a custom descriptor to serve, check its handle/uuid here.
@@ -471,6 +576,9 @@ gatt_svr_init(void)
     ble_svc_gatt_init();
     //ble_svc_ans_init();
 
+    ble_npl_callout_init(&notify_retry, nimble_port_get_dflt_eventq(),
+                         notify_retry_cb, NULL);
+
     rc = ble_gatts_count_cfg(gatt_svr_svcs);
     if (rc != 0) {
         return rc;
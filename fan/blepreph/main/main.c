@@ -17,6 +17,8 @@
  * under the License.
  */
 
+#include <stdio.h>
+#include <string.h>
 #include "esp_log.h"
 #include "nvs_flash.h"
 /* BLE */
@@ -27,15 +29,8 @@
 #include "console/console.h"
 #include "services/gap/ble_svc_gap.h"
 #include "bleprph.h"
-
-#if CONFIG_EXAMPLE_EXTENDED_ADV
-static uint8_t ext_adv_pattern_1[] = {
-    0x02, 0x01, 0x06,
-    0x03, 0x03, 0xab, 0xcd,
-    0x03, 0x03, 0x18, 0x11,
-    0x11, 0X09, 'A', 'i', 'r', 'S', 'h', 'f', 't', '-', 'F', 'A', 'N', '-', 'e', 'x', 't',
-};
-#endif
+#include "conn_table.h"
+#include "fan_adv.h"
 
 static const char *tag = "AS_FAN_prph_srvr";
 static int bleprph_gap_event(struct ble_gap_event *event, void *arg);
@@ -81,135 +76,58 @@ bleprph_print_conn_desc(struct ble_gap_conn_desc *desc)
 }
 #endif
 
-#if CONFIG_EXAMPLE_EXTENDED_ADV
 /**
- * Enables advertising with the following parameters:
- *     o General discoverable mode.
- *     o Undirected connectable mode.
+ * Is `addr` the remote's identity address (CONFIG_FAN_REMOTE_ADDR, written
+ * most significant byte first as print_addr() shows it)? An empty or
+ * malformed setting matches nothing.
  */
-static void
-ext_bleprph_advertise(void)
+static bool
+bleprph_is_remote(const ble_addr_t *addr)
 {
-    struct ble_gap_ext_adv_params params;
-    struct os_mbuf *data;
-    uint8_t instance = 0;
-    int rc;
-
-    /* First check if any instance is already active */
-    if(ble_gap_ext_adv_active(instance)) {
-        return;
+    static bool parsed;
+    static bool valid;
+    static uint8_t val[6];
+    unsigned int b[6];
+
+    if (!parsed) {
+        parsed = true;
+        valid = sscanf(CONFIG_FAN_REMOTE_ADDR, "%2x:%2x:%2x:%2x:%2x:%2x",
+                       &b[5], &b[4], &b[3], &b[2], &b[1], &b[0]) == 6;
+        for (int i = 0; valid && i < 6; i++) {
+            val[i] = (uint8_t)b[i];
+        }
+        if (!valid && CONFIG_FAN_REMOTE_ADDR[0] != '\0') {
+            MODLOG_DFLT(ERROR, "bad remote address '%s'\n", CONFIG_FAN_REMOTE_ADDR);
+        }
     }
-
-    /* use defaults for non-set params */
-    memset (&params, 0, sizeof(params));
-
-    /* enable connectable advertising */
-    params.connectable = 1;
-
-    /* advertise using random addr */
-    params.own_addr_type = BLE_OWN_ADDR_PUBLIC;
-
-    params.primary_phy = BLE_HCI_LE_PHY_1M;
-    params.secondary_phy = BLE_HCI_LE_PHY_2M;
-    params.tx_power = 127;
-    params.sid = 1;
-
-    params.itvl_min = BLE_GAP_ADV_FAST_INTERVAL1_MIN;
-    params.itvl_max = BLE_GAP_ADV_FAST_INTERVAL1_MIN;
-
-    /* configure instance 0 */
-    rc = ble_gap_ext_adv_configure(instance, &params, NULL,
-                                   bleprph_gap_event, NULL);
-    assert (rc == 0);
-
-    /* in this case only scan response is allowed */
-
-    /* get mbuf for scan rsp data */
-    data = os_msys_get_pkthdr(sizeof(ext_adv_pattern_1), 0);
-    assert(data);
-
-    /* fill mbuf with scan rsp data */
-    rc = os_mbuf_append(data, ext_adv_pattern_1, sizeof(ext_adv_pattern_1));
-    assert(rc == 0);
-
-    rc = ble_gap_ext_adv_set_data(instance, data);
-    assert (rc == 0);
-
-    /* start advertising */
-    rc = ble_gap_ext_adv_start(instance, 0, 0);
-    assert (rc == 0);
+    return valid && memcmp(addr->val, val, sizeof(val)) == 0;
 }
-#else
+
 /**
- * Enables advertising with the following parameters:
- *     o General discoverable mode.
- *     o Undirected connectable mode.
+ * Asks for the 2M PHY and the largest LL data length on a new link. Either
+ * request may be refused (a BLE 4.2 controller has no 2M PHY, an older peer
+ * may not support DLE); the link then stays on 1M / 27 bytes. The PHY and
+ * data length events record what was agreed in the connection table.
  */
 static void
-bleprph_advertise(void)
+bleprph_link_setup(uint16_t conn_handle)
 {
-    struct ble_gap_adv_params adv_params;
-    struct ble_hs_adv_fields fields;
-#if CONFIG_BT_NIMBLE_GAP_SERVICE
-    const char *name;
-#endif
     int rc;
 
-    /**
-     *  Set the advertisement data included in our advertisements:
-     *     o Flags (indicates advertisement type and other general info).
-     *     o Advertising tx power.
-     *     o Device name.
-     *     o 16-bit service UUIDs (alert notifications).
-     */
-
-    memset(&fields, 0, sizeof fields);
-
-    /* Advertise two flags:
-     *     o Discoverability in forthcoming advertisement (general)
-     *     o BLE-only (BR/EDR unsupported).
-     */
-    fields.flags = BLE_HS_ADV_F_DISC_GEN |
-                   BLE_HS_ADV_F_BREDR_UNSUP;
-
-    /* Indicate that the TX power level field should be included; have the
-     * stack fill this value automatically.  This is done by assigning the
-     * special value BLE_HS_ADV_TX_PWR_LVL_AUTO.
-     */
-    fields.tx_pwr_lvl_is_present = 1;
-    fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
-
-#if CONFIG_BT_NIMBLE_GAP_SERVICE
-    name = ble_svc_gap_device_name();
-    fields.name = (uint8_t *)name;
-    fields.name_len = strlen(name);
-    fields.name_is_complete = 1;
-#endif
-
-    fields.uuids16 = (ble_uuid16_t[]) {
-        BLE_UUID16_INIT(GATT_SVR_SVC_ALERT_UUID)
-    };
-    fields.num_uuids16 = 1;
-    fields.uuids16_is_complete = 1;
-
-    rc = ble_gap_adv_set_fields(&fields);
+#if CONFIG_BT_NIMBLE_50_FEATURE_SUPPORT
+    rc = ble_gap_set_prefered_le_phy(conn_handle, BLE_GAP_LE_PHY_2M_MASK,
+                                     BLE_GAP_LE_PHY_2M_MASK,
+                                     BLE_GAP_LE_PHY_CODED_ANY);
     if (rc != 0) {
-        MODLOG_DFLT(ERROR, "error setting advertisement data; rc=%d\n", rc);
-        return;
+        MODLOG_DFLT(WARN, "2M PHY request failed; staying on 1M; rc=%d\n", rc);
     }
+#endif
 
-    /* Begin advertising. */
-    memset(&adv_params, 0, sizeof adv_params);
-    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
-    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
-    rc = ble_gap_adv_start(own_addr_type, NULL, BLE_HS_FOREVER,
-                           &adv_params, bleprph_gap_event, NULL);
+    rc = ble_gap_set_data_len(conn_handle, CONN_LL_OCTETS_MAX, CONN_LL_TIME_MAX);
     if (rc != 0) {
-        MODLOG_DFLT(ERROR, "error enabling advertisement; rc=%d\n", rc);
-        return;
+        MODLOG_DFLT(WARN, "data length request failed; rc=%d\n", rc);
     }
 }
-#endif
 
 #if MYNEWT_VAL(BLE_POWER_CONTROL)
 static void bleprph_power_control(uint16_t conn_handle)
@@ -244,6 +162,8 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
 {
 #if NIMBLE_BLE_CONNECT
     struct ble_gap_conn_desc desc;
+    conn_ctx_t *c;
+    bool remote;
     int rc;
 #endif
 
@@ -258,31 +178,26 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
         if (event->connect.status == 0) {
             rc = ble_gap_conn_find(event->connect.conn_handle, &desc);
             assert(rc == 0);
-            /* Track this new connection in the GATT server helper */
-            int idx = add_connection_handle(event->connect.conn_handle);
-            MODLOG_DFLT(INFO, "added conn_handle=%d as idx=%d\n",
-                        event->connect.conn_handle, idx);
             bleprph_print_conn_desc(&desc);
 
-            /* If we still have room for more connections, keep advertising */
-            if (count_active_connections() < 2) {
-#if CONFIG_EXAMPLE_EXTENDED_ADV
-                ext_bleprph_advertise();
-#else
-                bleprph_advertise();
-#endif
+            /* Track this new connection; refuse it if the table is full */
+            c = conn_table_add(event->connect.conn_handle);
+            if (c == NULL) {
+                MODLOG_DFLT(INFO, "\nconn table full; rejecting conn_handle=%d\n",
+                            event->connect.conn_handle);
+                ble_gap_terminate(event->connect.conn_handle, BLE_ERR_CONN_LIMIT);
+                return 0;
+            }
+            if (bleprph_is_remote(&desc.peer_id_addr)) {
+                c->role = CONN_ROLE_REMOTE;
             }
+            bleprph_link_setup(event->connect.conn_handle);
+            fan_adv_on_connect(&desc);
         }
         MODLOG_DFLT(INFO, "\n");
 
-        if (event->connect.status != 0) {
-            /* Connection failed; resume advertising. */
-#if CONFIG_EXAMPLE_EXTENDED_ADV
-            ext_bleprph_advertise();
-#else
-            bleprph_advertise();
-#endif
-        }
+        /* Connection failed, or room for more connections: keep advertising */
+        fan_adv_resume();
 
 #if MYNEWT_VAL(BLE_POWER_CONTROL)
 	bleprph_power_control(event->connect.conn_handle);
@@ -294,16 +209,18 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
         bleprph_print_conn_desc(&event->disconnect.conn);
         MODLOG_DFLT(INFO, "\n");
 
-    /* Remove from our connection tracking and resume advertising if
-     * we have fewer than two active connections.
+    /* Remove from our connection tracking. The remote gets directed
+     * advertising to reconnect; anyone else fast advertising so they can
+     * come straight back.
      */
-    remove_connection_handle(event->disconnect.conn.conn_handle);
-    if (count_active_connections() < 2) {
-#if CONFIG_EXAMPLE_EXTENDED_ADV
-        ext_bleprph_advertise();
-#else
-        bleprph_advertise();
-#endif
+    c = conn_table_get(event->disconnect.conn.conn_handle);
+    remote = c != NULL && c->role == CONN_ROLE_REMOTE;
+    gatt_svr_on_disconnect(event->disconnect.conn.conn_handle);
+    conn_table_remove(event->disconnect.conn.conn_handle);
+    if (remote) {
+        fan_adv_reconnect(&event->disconnect.conn);
+    } else {
+        fan_adv_kick();
     }
         return 0;
 
@@ -320,14 +237,9 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
     case BLE_GAP_EVENT_ADV_COMPLETE:
     MODLOG_DFLT(INFO, "advertise complete; reason=%d",
             event->adv_complete.reason);
-    /* Only restart advertising if we still need connections. */
-    if (count_active_connections() < 2) {
-#if CONFIG_EXAMPLE_EXTENDED_ADV
-        ext_bleprph_advertise();
-#else
-        bleprph_advertise();
-#endif
-    }
+    /* Only restart advertising if we still need connections. The end of
+     * the fast phase also lands here and continues slow. */
+    fan_adv_resume();
         return 0;
 
     case BLE_GAP_EVENT_ENC_CHANGE:
@@ -347,6 +259,11 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
                     event->notify_tx.attr_handle,
                     event->notify_tx.status,
                     event->notify_tx.indication);
+        if (!event->notify_tx.indication) {
+            gatt_svr_on_notify_tx(event->notify_tx.conn_handle,
+                                  event->notify_tx.attr_handle,
+                                  event->notify_tx.status);
+        }
         return 0;
 
     case BLE_GAP_EVENT_SUBSCRIBE:
@@ -359,6 +276,9 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
                     event->subscribe.cur_notify,
                     event->subscribe.prev_indicate,
                     event->subscribe.cur_indicate);
+        gatt_svr_on_subscribe(event->subscribe.conn_handle,
+                              event->subscribe.attr_handle,
+                              event->subscribe.cur_notify);
         return 0;
 
     case BLE_GAP_EVENT_MTU:
@@ -366,6 +286,41 @@ bleprph_gap_event(struct ble_gap_event *event, void *arg)
                     event->mtu.conn_handle,
                     event->mtu.channel_id,
                     event->mtu.value);
+        {
+            conn_ctx_t *c = conn_table_get(event->mtu.conn_handle);
+            if (c) {
+                c->mtu = event->mtu.value;
+            }
+        }
+        return 0;
+
+    case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+        MODLOG_DFLT(INFO, "phy update; conn_handle=%d status=%d tx_phy=%d rx_phy=%d\n",
+                    event->phy_updated.conn_handle,
+                    event->phy_updated.status,
+                    event->phy_updated.tx_phy,
+                    event->phy_updated.rx_phy);
+        if (event->phy_updated.status == 0) {
+            conn_ctx_t *c = conn_table_get(event->phy_updated.conn_handle);
+            if (c) {
+                c->tx_phy = event->phy_updated.tx_phy;
+                c->rx_phy = event->phy_updated.rx_phy;
+            }
+        }
+        return 0;
+
+    case BLE_GAP_EVENT_DATA_LEN_CHG:
+        MODLOG_DFLT(INFO, "data length; conn_handle=%d max_tx=%d max_rx=%d\n",
+                    event->data_len_chg.conn_handle,
+                    event->data_len_chg.max_tx_octets,
+                    event->data_len_chg.max_rx_octets);
+        {
+            conn_ctx_t *c = conn_table_get(event->data_len_chg.conn_handle);
+            if (c) {
+                c->tx_octets = event->data_len_chg.max_tx_octets;
+                c->rx_octets = event->data_len_chg.max_rx_octets;
+            }
+        }
         return 0;
 
     case BLE_GAP_EVENT_REPEAT_PAIRING:
@@ -524,6 +479,12 @@ ble_app_set_addr(void)
 }
 #endif
 
+/* What this fan advertises itself as: no status record or packet
+ * characteristic, just the per-field services */
+static const fan_ident_t s_fan_ident = {
+    .model = FAN_IDENT_MODEL_BASIC,
+};
+
 static void
 bleprph_on_sync(void)
 {
@@ -556,12 +517,9 @@ bleprph_on_sync(void)
     MODLOG_DFLT(INFO, "Device Address: ");
     print_addr(addr_val);
     MODLOG_DFLT(INFO, "\n");
-    /* Begin advertising. */
-#if CONFIG_EXAMPLE_EXTENDED_ADV
-    ext_bleprph_advertise();
-#else
-    bleprph_advertise();
-#endif
+    /* Begin advertising, fast phase first. */
+    fan_adv_init(own_addr_type, &s_fan_ident, bleprph_gap_event);
+    fan_adv_kick();
 }
 
 void bleprph_host_task(void *param)
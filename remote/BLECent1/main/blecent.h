@@ -39,6 +39,33 @@ union ble_store_key;
 #define BLECENT_CHR_UNR_ALERT_STAT_UUID     0x2A45
 #define BLECENT_CHR_ALERT_NOT_CTRL_PT       0x2A44
 
+/* Fan aggregate status record (fan_status.h on the fan side):
+ * ver flags power light rpm(le32) angle(le32) seq(le16) ack(le16) clock(le16) */
+#define BLECENT_FAN_STATUS_VERSION          3
+#define BLECENT_FAN_STATUS_LEN              18
+#define BLECENT_FAN_STATUS_F_ACK            0x01
+
+/* Fan status beacon (fan_adv.h on the fan side): manufacturer data under
+ * BLECENT_FAN_COMPANY_ID, also carried by the fan's periodic train
+ *     ver power light wifi rpm(le32) angle(le32) seq(le16) */
+#define BLECENT_FAN_COMPANY_ID              0xFFFF
+#define BLECENT_FAN_BEACON_VERSION          1
+#define BLECENT_FAN_BEACON_LEN              14
+#define BLECENT_FAN_TRAIN_SID               2
+
+/* Fan identity (fan_adv.h on the fan side): manufacturer data under
+ * BLECENT_FAN_COMPANY_ID right after the flags of the fan's connectable
+ * advertising, at BLECENT_FAN_IDENT_OFFSET
+ *     model caps state_version */
+#define BLECENT_FAN_IDENT_OFFSET            3
+#define BLECENT_FAN_IDENT_LEN               3
+
+/* LL payload size before and after Data Length Extension, and the packet
+ * time that fits the largest payload on the 1M PHY */
+#define BLECENT_LL_OCTETS_DFLT              27
+#define BLECENT_LL_OCTETS_MAX               251
+#define BLECENT_LL_TIME_MAX                 2120
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,117 @@
+/* fan_cli.c
+ * Console front end for fan_ctrl, so the control channel can be driven and
+ * checked from a terminal:
+ *
+ *     remote> fan rpm=1200 angle=45 light=1 power=1
+ *
+ * Any subset of the fields may be given; each command becomes one
+ * FAN_OP_SEQ_SET packet. Several commands typed quickly share the window.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host/ble_hs.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "fan_ctrl.h"
+#include "fan_cli.h"
+
+static const char *TAG = "fan_cli";
+
+static const char USAGE[] = "usage: fan [rpm=N] [angle=N] [light=0|1] [power=0|1]\n";
+
+static int cmd_fan(int argc, char **argv)
+{
+    uint32_t fields = 0;
+    uint32_t rpm = 0, angle = 0;
+    uint8_t light = 0, power = 0;
+    int rc;
+
+    for (int i = 1; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        char *end;
+        unsigned long v;
+
+        if (eq == NULL) {
+            fputs(USAGE, stdout);
+            return 1;
+        }
+        *eq = '\0';
+        v = strtoul(eq + 1, &end, 0);
+        if (end == eq + 1 || *end != '\0') {
+            fputs(USAGE, stdout);
+            return 1;
+        }
+        if (strcmp(argv[i], "rpm") == 0) {
+            rpm = (uint32_t)v;
+            fields |= FAN_CTRL_F_RPM;
+        } else if (strcmp(argv[i], "angle") == 0) {
+            angle = (uint32_t)v;
+            fields |= FAN_CTRL_F_ANGLE;
+        } else if (strcmp(argv[i], "light") == 0 && v <= 1) {
+            light = (uint8_t)v;
+            fields |= FAN_CTRL_F_LIGHT;
+        } else if (strcmp(argv[i], "power") == 0 && v <= 1) {
+            power = (uint8_t)v;
+            fields |= FAN_CTRL_F_POWER;
+        } else {
+            fputs(USAGE, stdout);
+            return 1;
+        }
+    }
+    if (fields == 0) {
+        fputs(USAGE, stdout);
+        return 1;
+    }
+
+    rc = fan_ctrl_send(fields, rpm, angle, light, power);
+    if (rc == BLE_HS_ENOTCONN) {
+        printf("no fan connected\n");
+    } else if (rc == BLE_HS_EBUSY) {
+        printf("control window full, try again\n");
+    }
+    return rc == 0 ? 0 : 1;
+}
+
+int fan_cli_init(void)
+{
+    esp_console_repl_t *repl = NULL;
+    esp_console_repl_config_t repl_cfg = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    const esp_console_cmd_t cmd = {
+        .command = "fan",
+        .help = "Set fan fields over the control channel, "
+                "e.g. fan rpm=1200 angle=45 light=1 power=1",
+        .func = &cmd_fan,
+    };
+    esp_err_t err;
+
+    repl_cfg.prompt = "remote>";
+#if CONFIG_ESP_CONSOLE_UART_DEFAULT || CONFIG_ESP_CONSOLE_UART_CUSTOM
+    esp_console_dev_uart_config_t dev_cfg = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    err = esp_console_new_repl_uart(&dev_cfg, &repl_cfg, &repl);
+#elif CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+    esp_console_dev_usb_serial_jtag_config_t dev_cfg =
+        ESP_CONSOLE_DEV_USB_SERIAL_JTAG_CONFIG_DEFAULT();
+    err = esp_console_new_repl_usb_serial_jtag(&dev_cfg, &repl_cfg, &repl);
+#else
+    err = ESP_ERR_NOT_SUPPORTED;
+#endif
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "console REPL failed: %s", esp_err_to_name(err));
+        return -1;
+    }
+
+    err = esp_console_cmd_register(&cmd);
+    if (err == ESP_OK) {
+        err = esp_console_start_repl(repl);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "console start failed: %s", esp_err_to_name(err));
+        return -1;
+    }
+    return 0;
+}
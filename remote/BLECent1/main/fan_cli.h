@@ -0,0 +1,17 @@
+#pragma once
+/* fan_cli.h
+ * Serial console commands that drive the fan over the sequenced control
+ * channel (fan_ctrl).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Start the console REPL and register the `fan` command. Call once from
+ * app_main after fan_ctrl_init(). */
+int fan_cli_init(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,294 @@
+/* fan_ctrl.c
+ * Sequenced write-without-response control channel to the fan.
+ *
+ * Commands stay in a small window until the fan acknowledges them. A new
+ * command is written at once without waiting for an ATT write response, so
+ * several can share one connection event. The fan acks cumulatively (the
+ * last sequence number it applied in order) and drops anything after a gap,
+ * so on a timeout the whole window is resent in order (go-back-N).
+ *
+ * The fan takes the first packet it sees on a connection as its starting
+ * point. Until that one is acked it is the only packet in flight; otherwise
+ * losing it would make the fan start from the second one and skip it.
+ */
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "host/ble_hs.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "fan_ctrl.h"
+
+static const char *TAG = "fan_ctrl";
+
+/* hdr, seq(2), rpm and angle (tag + up to 4), light and power (tag + 1),
+ * clock (tag + 2) */
+#define FRAME_MAX (1 + 2 + 5 + 5 + 2 + 2 + 3)
+
+typedef struct {
+    uint8_t len;
+    uint8_t buf[FRAME_MAX];
+} frame_t;
+
+static struct {
+    bool     attached;
+    bool     synced;        /* the fan has acked at least one packet */
+    uint16_t conn_handle;
+    uint16_t val_handle;
+    uint16_t next_seq;
+    bool     has_clock;
+    uint16_t clock;         /* Lamport clock: past every status, +1 per write */
+    uint8_t  count;         /* frames[0..count) wait for an ack */
+    uint8_t  sent;          /* frames[0..sent) have been written */
+    uint8_t  retries;
+    frame_t  frames[CONFIG_FAN_CTRL_WINDOW];
+} s_ch;
+
+static esp_timer_handle_t s_timer;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t put_le(uint8_t *p, uint32_t v, uint8_t n)
+{
+    for (uint8_t i = 0; i < n; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+    return n;
+}
+
+/* Fewest little-endian bytes holding v (at least one) */
+static uint8_t le_width(uint32_t v)
+{
+    uint8_t n = 1;
+    while (n < 4 && (v >> (8 * n)) != 0) {
+        n++;
+    }
+    return n;
+}
+
+/* Under s_mux */
+static void frame_encode(frame_t *f, uint16_t seq, uint32_t fields, uint32_t rpm,
+                         uint32_t angle, uint8_t light, uint8_t power)
+{
+    uint8_t *p = f->buf;
+    uint8_t n;
+
+    *p++ = FAN_CTRL_PKT_HDR_SEQ_SET;
+    p += put_le(p, seq, 2);
+    if (fields & FAN_CTRL_F_RPM) {
+        n = le_width(rpm);
+        *p++ = FAN_CTRL_TLV(FAN_CTRL_TLV_RPM, n);
+        p += put_le(p, rpm, n);
+    }
+    if (fields & FAN_CTRL_F_ANGLE) {
+        n = le_width(angle);
+        *p++ = FAN_CTRL_TLV(FAN_CTRL_TLV_ANGLE, n);
+        p += put_le(p, angle, n);
+    }
+    if (fields & FAN_CTRL_F_LIGHT) {
+        *p++ = FAN_CTRL_TLV(FAN_CTRL_TLV_LIGHT, 1);
+        *p++ = light;
+    }
+    if (fields & FAN_CTRL_F_POWER) {
+        *p++ = FAN_CTRL_TLV(FAN_CTRL_TLV_POWER, 1);
+        *p++ = power;
+    }
+    if (s_ch.has_clock) {
+        s_ch.clock++;
+        *p++ = FAN_CTRL_TLV(FAN_CTRL_TLV_CLOCK, 2);
+        p += put_le(p, s_ch.clock, 2);
+    }
+    f->len = (uint8_t)(p - f->buf);
+}
+
+/* Under s_mux: copy the frames from `from` up to what may be in flight into
+ * out[] and mark them sent. Returns how many were copied. */
+static int take_frames(uint8_t from, frame_t *out)
+{
+    uint8_t limit = s_ch.synced ? s_ch.count : (s_ch.count ? 1 : 0);
+    int n = 0;
+
+    for (uint8_t i = from; i < limit; i++) {
+        out[n++] = s_ch.frames[i];
+    }
+    if (limit > s_ch.sent) {
+        s_ch.sent = limit;
+    }
+    return n;
+}
+
+static void write_frames(uint16_t conn_handle, uint16_t val_handle,
+                         const frame_t *f, int n)
+{
+    for (int i = 0; i < n; i++) {
+        int rc = ble_gattc_write_no_rsp_flat(conn_handle, val_handle,
+                                             f[i].buf, f[i].len);
+        if (rc != 0) {
+            /* out of buffers: the retry timer resends it */
+            ESP_LOGW(TAG, "write failed; rc=%d", rc);
+            break;
+        }
+    }
+}
+
+static void arm_retry(void)
+{
+    esp_timer_stop(s_timer);    /* may already be idle */
+    esp_timer_start_once(s_timer, (uint64_t)CONFIG_FAN_CTRL_RETRY_MS * 1000);
+}
+
+static void retry_timer_cb(void *arg)
+{
+    frame_t out[CONFIG_FAN_CTRL_WINDOW];
+    uint16_t conn_handle;
+    uint16_t val_handle;
+    int n;
+
+    portENTER_CRITICAL(&s_mux);
+    if (!s_ch.attached || s_ch.count == 0) {
+        portEXIT_CRITICAL(&s_mux);
+        return;
+    }
+    conn_handle = s_ch.conn_handle;
+    if (++s_ch.retries > CONFIG_FAN_CTRL_MAX_RETRIES) {
+        n = s_ch.count;
+        s_ch.count = 0;
+        s_ch.sent = 0;
+        portEXIT_CRITICAL(&s_mux);
+        /* The fan's ack is stuck behind the lost packets; only a new
+         * connection gets both sides back to the same starting point. */
+        ESP_LOGW(TAG, "no ack after %d retries, dropping %d commands",
+                 CONFIG_FAN_CTRL_MAX_RETRIES, n);
+        ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return;
+    }
+    val_handle = s_ch.val_handle;
+    n = take_frames(0, out);
+    portEXIT_CRITICAL(&s_mux);
+
+    write_frames(conn_handle, val_handle, out, n);
+    arm_retry();
+}
+
+int fan_ctrl_send(uint32_t fields, uint32_t rpm, uint32_t angle,
+                  uint8_t light, uint8_t power)
+{
+    frame_t out[CONFIG_FAN_CTRL_WINDOW];
+    uint16_t conn_handle;
+    uint16_t val_handle;
+    bool first;
+    int n;
+
+    portENTER_CRITICAL(&s_mux);
+    if (!s_ch.attached) {
+        portEXIT_CRITICAL(&s_mux);
+        return BLE_HS_ENOTCONN;
+    }
+    if (s_ch.count == CONFIG_FAN_CTRL_WINDOW) {
+        portEXIT_CRITICAL(&s_mux);
+        return BLE_HS_EBUSY;
+    }
+    frame_encode(&s_ch.frames[s_ch.count++], s_ch.next_seq++,
+                 fields, rpm, angle, light, power);
+    first = s_ch.count == 1;
+    conn_handle = s_ch.conn_handle;
+    val_handle = s_ch.val_handle;
+    n = take_frames(s_ch.sent, out);
+    portEXIT_CRITICAL(&s_mux);
+
+    write_frames(conn_handle, val_handle, out, n);
+    if (first) {
+        arm_retry();
+    }
+    return 0;
+}
+
+void fan_ctrl_on_status(uint16_t conn_handle, bool has_ack, uint16_t ack,
+                        uint16_t clock)
+{
+    frame_t out[CONFIG_FAN_CTRL_WINDOW];
+    uint16_t val_handle;
+    bool more;
+    int n;
+
+    portENTER_CRITICAL(&s_mux);
+    if (!s_ch.attached || s_ch.conn_handle != conn_handle) {
+        portEXIT_CRITICAL(&s_mux);
+        return;
+    }
+    if (!s_ch.has_clock || (int16_t)(clock - s_ch.clock) > 0) {
+        s_ch.clock = clock;
+    }
+    s_ch.has_clock = true;
+    if (!has_ack || s_ch.count == 0) {
+        portEXIT_CRITICAL(&s_mux);
+        return;
+    }
+    /* how many frames from the oldest one the ack covers; an old or
+     * duplicate ack wraps around to a large value and is ignored */
+    uint16_t base = (uint16_t)(s_ch.next_seq - s_ch.count);
+    uint16_t done = (uint16_t)(ack - base) + 1;
+    if (done == 0 || done > s_ch.count) {
+        portEXIT_CRITICAL(&s_mux);
+        return;
+    }
+    memmove(&s_ch.frames[0], &s_ch.frames[done],
+            (s_ch.count - done) * sizeof(frame_t));
+    s_ch.count -= done;
+    s_ch.sent = s_ch.sent > done ? s_ch.sent - done : 0;
+    s_ch.retries = 0;
+    s_ch.synced = true;
+    val_handle = s_ch.val_handle;
+    n = take_frames(s_ch.sent, out);    /* held back until now */
+    more = s_ch.count != 0;
+    portEXIT_CRITICAL(&s_mux);
+
+    write_frames(conn_handle, val_handle, out, n);
+    if (more) {
+        arm_retry();
+    } else {
+        esp_timer_stop(s_timer);
+    }
+}
+
+void fan_ctrl_attach(uint16_t conn_handle, uint16_t val_handle)
+{
+    portENTER_CRITICAL(&s_mux);
+    s_ch.attached = true;
+    s_ch.synced = false;
+    s_ch.has_clock = false;
+    s_ch.conn_handle = conn_handle;
+    s_ch.val_handle = val_handle;
+    s_ch.count = 0;
+    s_ch.sent = 0;
+    s_ch.retries = 0;
+    portEXIT_CRITICAL(&s_mux);
+    ESP_LOGI(TAG, "attached; conn_handle=%d val_handle=%d", conn_handle, val_handle);
+}
+
+void fan_ctrl_detach(uint16_t conn_handle)
+{
+    portENTER_CRITICAL(&s_mux);
+    bool ours = s_ch.attached && s_ch.conn_handle == conn_handle;
+    if (ours) {
+        s_ch.attached = false;
+        s_ch.count = 0;
+        s_ch.sent = 0;
+    }
+    portEXIT_CRITICAL(&s_mux);
+
+    if (ours) {
+        esp_timer_stop(s_timer);
+    }
+}
+
+int fan_ctrl_init(void)
+{
+    const esp_timer_create_args_t args = {
+        .callback = retry_timer_cb,
+        .name = "fan_ctrl",
+    };
+    return esp_timer_create(&args, &s_timer) == ESP_OK ? 0 : -1;
+}
@@ -0,0 +1,54 @@
+#pragma once
+/* fan_ctrl.h
+ * Sequenced control channel to the fan: FAN_OP_SEQ_SET packets written
+ * without response to the fan's packet characteristic, acknowledged through
+ * the `ack` field of the aggregate status notifications.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fields to set (same bits as FAN_CMD_F_* on the fan) */
+#define FAN_CTRL_F_RPM      (1u << 0)
+#define FAN_CTRL_F_ANGLE    (1u << 1)
+#define FAN_CTRL_F_LIGHT    (1u << 2)
+#define FAN_CTRL_F_POWER    (1u << 3)
+
+/* Binary packet framing (fan_cmd.h on the fan side) */
+#define FAN_CTRL_PKT_HDR_SEQ_SET    0x92    /* binary, version 1, FAN_OP_SEQ_SET */
+#define FAN_CTRL_TLV(type, len)     (uint8_t)(((type) << 4) | (len))
+#define FAN_CTRL_TLV_RPM            0x1
+#define FAN_CTRL_TLV_ANGLE          0x2
+#define FAN_CTRL_TLV_LIGHT          0x3
+#define FAN_CTRL_TLV_POWER          0x4
+#define FAN_CTRL_TLV_CLOCK          0x7
+
+/* Called by app_main once at startup */
+int fan_ctrl_init(void);
+
+/* The fan's packet characteristic was found on `conn_handle`. Resets the
+ * window; the fan restarts its ack from our first packet. */
+void fan_ctrl_attach(uint16_t conn_handle, uint16_t val_handle);
+void fan_ctrl_detach(uint16_t conn_handle);
+
+/* Send one command. Up to CONFIG_FAN_CTRL_WINDOW commands can be in flight
+ * and go out back to back; unacknowledged ones are resent in order.
+ * Each command carries a Lamport timestamp kept past the fan's status
+ * clock, so the fan resolves writes from several clients by last writer
+ * wins; the status that follows shows the winning values.
+ * Returns 0, BLE_HS_ENOTCONN without a fan, or BLE_HS_EBUSY if the window
+ * is full. */
+int fan_ctrl_send(uint32_t fields, uint32_t rpm, uint32_t angle,
+                  uint8_t light, uint8_t power);
+
+/* A fan status record received on `conn_handle`: its ack (if `has_ack`)
+ * and control clock */
+void fan_ctrl_on_status(uint16_t conn_handle, bool has_ack, uint16_t ack,
+                        uint16_t clock);
+
+#ifdef __cplusplus
+}
+#endif
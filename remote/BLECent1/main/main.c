@@ -18,6 +18,7 @@
  */
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 /* BLE */
 #include "nimble/nimble_port.h"
@@ -27,6 +28,9 @@
 #include "console/console.h"
 #include "services/gap/ble_svc_gap.h"
 #include "blecent.h"
+#include "mbuf_cursor.h"
+#include "fan_ctrl.h"
+#include "fan_cli.h"
 #if MYNEWT_VAL(BLE_GATT_CACHING)
 #include "host/ble_esp_gattc_cache.h"
 #endif
@@ -63,11 +67,32 @@ static const ble_uuid_t * remote_svc_uuid =
 static const ble_uuid_t * remote_chr_uuid =
     BLE_UUID128_DECLARE(0x00, 0x00, 0x00, 0x00, 0x11, 0x11, 0x11, 0x11,
                      	0x22, 0x22, 0x22, 0x22, 0x33, 0x33, 0x33, 0x33);
+
+/*** Fan control service and its packet characteristic ***/
+static const ble_uuid_t * fan_ctrl_svc_uuid =
+    BLE_UUID128_DECLARE(0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0x11, 0x00,
+                        0x10, 0x01, 0x10, 0x11, 0xAA, 0xAA, 0xAA, 0xAA);
+static const ble_uuid_t * fan_pkt_chr_uuid =
+    BLE_UUID128_DECLARE(0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                        0x20, 0x20, 0x20, 0x20, 0x30, 0x30, 0x30, 0x30);
+
+/*** Fan status service and its aggregate status characteristic ***/
+static const ble_uuid_t * fan_stat_svc_uuid =
+    BLE_UUID128_DECLARE(0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0x32, 0x43,
+                        0x54, 0x65, 0x76, 0x87, 0xAA, 0xAA, 0xAA, 0xAA);
+static const ble_uuid_t * fan_stat_all_uuid =
+    BLE_UUID128_DECLARE(0x05, 0x57, 0xBE, 0xEF, 0xEF, 0xBE, 0xAD, 0xDE,
+                        0x90, 0xAB, 0xCD, 0xEF, 0xFE, 0xDC, 0xBA, 0x98);
 #endif
 
 static const char *tag = "NimBLE_BLE_CENT";
 static int blecent_gap_event(struct ble_gap_event *event, void *arg);
 
+/* Aggregate status characteristic of the attached fan; only notifications
+ * from it are decoded as status records */
+static uint16_t blecent_stat_conn = BLE_HS_CONN_HANDLE_NONE;
+static uint16_t blecent_stat_handle;
+
 #if MYNEWT_VAL(BLE_EATT_CHAN_NUM) > 0
 static uint16_t cids[MYNEWT_VAL(BLE_EATT_CHAN_NUM)];
 static uint16_t bearers;
@@ -406,6 +431,65 @@ err:
     ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
 }
 
+/**
+ * Application callback.  Called when the subscription to the fan's
+ * aggregate status characteristic has completed.
+ */
+static int
+blecent_on_fan_subscribe(uint16_t conn_handle,
+                         const struct ble_gatt_error *error,
+                         struct ble_gatt_attr *attr,
+                         void *arg)
+{
+    MODLOG_DFLT(INFO, "Fan status subscribe complete; status=%d conn_handle=%d\n",
+                error->status, conn_handle);
+    if (error->status != 0) {
+        /* without status notifications there are no acks */
+        fan_ctrl_detach(conn_handle);
+    }
+    return 0;
+}
+
+/**
+ * If the peer is a fan, subscribe to its aggregate status (which carries
+ * the control channel acks) and attach the sequenced control channel to
+ * its packet characteristic.
+ *
+ * @return                      0 if the peer is a fan; BLE_HS_ENOENT if it
+ *                                  lacks the fan services.
+ */
+static int
+blecent_fan_attach(const struct peer *peer)
+{
+    const struct peer_chr *chr;
+    const struct peer_chr *stat;
+    const struct peer_dsc *dsc;
+    uint8_t value[2];
+    int rc;
+
+    chr = peer_chr_find_uuid(peer, fan_ctrl_svc_uuid, fan_pkt_chr_uuid);
+    stat = peer_chr_find_uuid(peer, fan_stat_svc_uuid, fan_stat_all_uuid);
+    dsc = peer_dsc_find_uuid(peer, fan_stat_svc_uuid, fan_stat_all_uuid,
+                             BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
+    if (chr == NULL || stat == NULL || dsc == NULL) {
+        return BLE_HS_ENOENT;
+    }
+
+    blecent_stat_conn = peer->conn_handle;
+    blecent_stat_handle = stat->chr.val_handle;
+    fan_ctrl_attach(peer->conn_handle, chr->chr.val_handle);
+
+    value[0] = 1;
+    value[1] = 0;
+    rc = ble_gattc_write_flat(peer->conn_handle, dsc->dsc.handle,
+                              value, sizeof value, blecent_on_fan_subscribe, NULL);
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "Error: Failed to subscribe to fan status; rc=%d\n", rc);
+        fan_ctrl_detach(peer->conn_handle);
+    }
+    return 0;
+}
+
 /**
  * Called when service discovery of the specified peer has completed.
  */
@@ -428,9 +512,12 @@ blecent_on_disc_complete(const struct peer *peer, int status, void *arg)
     MODLOG_DFLT(INFO, "Service discovery complete; status=%d "
                 "conn_handle=%d\n", status, peer->conn_handle);
 
-    /* Now perform three GATT procedures against the peer: read,
-     * write, and subscribe to notifications for the ANS service.
+    /* A fan gets the control channel; any other peer the three ANS
+     * procedures: read, write, and subscribe to notifications.
      */
+    if (blecent_fan_attach(peer) == 0) {
+        return;
+    }
     blecent_read_write_subscribe(peer);
 }
 #endif  //MYNEWT_VAL(BLE_GATTC)
@@ -477,17 +564,75 @@ blecent_scan(void)
     }
 }
 
+/* The fan we were last connected to. When it loses us it advertises
+ * directed at us, and those packets carry no data to recognise it by. */
+static ble_addr_t blecent_fan_addr;
+static bool blecent_fan_known;
+static int64_t blecent_fan_lost_at;     /* 0 = connected, or never was */
+
+/**
+ * Indicates whether an advertisement is the fan we were last connected to
+ * asking for us back; we connect at once, without the identity check.
+ */
+static int
+blecent_is_fan_calling(uint8_t event_type, const ble_addr_t *addr)
+{
+    return event_type == BLE_HCI_ADV_RPT_EVTYPE_DIR_IND && blecent_fan_known &&
+           ble_addr_cmp(addr, &blecent_fan_addr) == 0;
+}
+
+/**
+ * Remember the fan on a new connection and, if it is the one we lost,
+ * report how long the reconnect took.
+ */
+static void
+blecent_fan_connected(const struct ble_gap_conn_desc *desc)
+{
+    if (blecent_fan_lost_at != 0 &&
+        ble_addr_cmp(&desc->peer_id_addr, &blecent_fan_addr) == 0) {
+        MODLOG_DFLT(INFO, "fan back in %lu ms\n", (unsigned long)
+                    ((esp_timer_get_time() - blecent_fan_lost_at) / 1000));
+    }
+    blecent_fan_addr = desc->peer_id_addr;
+    blecent_fan_known = true;
+    blecent_fan_lost_at = 0;
+}
+
+static void
+blecent_fan_disconnected(const struct ble_gap_conn_desc *desc)
+{
+    if (blecent_fan_known &&
+        ble_addr_cmp(&desc->peer_id_addr, &blecent_fan_addr) == 0) {
+        blecent_fan_lost_at = esp_timer_get_time();
+    }
+}
+
+/**
+ * Whether advertising data carries the fan identity. The fan puts it at a
+ * fixed offset, so this is one compare of its header, no AD parsing. The
+ * length differs from the status beacon's, which shares the company ID.
+ */
+static bool
+blecent_has_fan_ident(const uint8_t *data, uint8_t len)
+{
+    static const uint8_t hdr[] = {
+        BLECENT_FAN_IDENT_LEN + 3, BLE_HS_ADV_TYPE_MFG_DATA,
+        BLECENT_FAN_COMPANY_ID & 0xff, BLECENT_FAN_COMPANY_ID >> 8,
+    };
+
+    return len >= BLECENT_FAN_IDENT_OFFSET + sizeof(hdr) + BLECENT_FAN_IDENT_LEN &&
+           memcmp(&data[BLECENT_FAN_IDENT_OFFSET], hdr, sizeof(hdr)) == 0;
+}
+
 /**
  * Indicates whether we should try to connect to the sender of the specified
  * advertisement.  The function returns a positive result if the device
- * advertises connectability and support for the Alert Notification service.
+ * advertises connectability and the fan identity.
  */
 #if CONFIG_EXAMPLE_EXTENDED_ADV
 static int
 ext_blecent_should_connect(const struct ble_gap_ext_disc_desc *disc)
 {
-    int offset = 0;
-    int ad_struct_len = 0;
 #if CONFIG_EXAMPLE_USE_CI_ADDRESS
     uint32_t *addr_offset;
 #endif // CONFIG_EXAMPLE_USE_CI_ADDRESS
@@ -500,6 +645,9 @@ ext_blecent_should_connect(const struct ble_gap_ext_disc_desc *disc)
             disc->legacy_event_type != BLE_HCI_ADV_RPT_EVTYPE_DIR_IND) {
         return 0;
     }
+    if (blecent_is_fan_calling(disc->legacy_event_type, &disc->addr)) {
+        return 1;
+    }
     if (strlen(CONFIG_EXAMPLE_PEER_ADDR) && (strncmp(CONFIG_EXAMPLE_PEER_ADDR, "ADDR_ANY", strlen    ("ADDR_ANY")) != 0)) {
 #if !CONFIG_EXAMPLE_USE_CI_ADDRESS
         //ESP_LOGI(tag, "Peer address from menuconfig: %s", CONFIG_EXAMPLE_PEER_ADDR);
@@ -525,36 +673,13 @@ ext_blecent_should_connect(const struct ble_gap_ext_disc_desc *disc)
         }
     }
 
-    /* The device has to advertise support for the Alert Notification
-    * service (0x1811).
-    */
-    do {
-        ad_struct_len = disc->data[offset];
-
-        if (!ad_struct_len) {
-            break;
-        }
-
-	/* Search if ANS UUID is advertised */
-        if (disc->data[offset] == 0x03 && disc->data[offset + 1] == 0x03) {
-            if ( disc->data[offset + 2] == 0x18 && disc->data[offset + 3] == 0x11 ) {
-                return 1;
-            }
-        }
-
-        offset += ad_struct_len + 1;
-
-     } while ( offset < disc->length_data );
-
-    return 0;
+    /* The device has to advertise the fan identity. */
+    return blecent_has_fan_ident(disc->data, disc->length_data);
 }
 #else
 static int
 blecent_should_connect(const struct ble_gap_disc_desc *disc)
 {
-    struct ble_hs_adv_fields fields;
-    int rc;
-    int i;
 #if CONFIG_EXAMPLE_USE_CI_ADDRESS
     uint32_t *addr_offset;
 #endif // CONFIG_EXAMPLE_USE_CI_ADDRESS
@@ -569,10 +694,8 @@ blecent_should_connect(const struct ble_gap_disc_desc *disc)
 
         return 0;
     }
-
-    rc = ble_hs_adv_parse_fields(&fields, disc->data, disc->length_data);
-    if (rc != 0) {
-        return 0;
+    if (blecent_is_fan_calling(disc->event_type, &disc->addr)) {
+        return 1;
     }
 
     if (strlen(CONFIG_EXAMPLE_PEER_ADDR) && (strncmp(CONFIG_EXAMPLE_PEER_ADDR, "ADDR_ANY", strlen("ADDR_ANY")) != 0)) {
@@ -602,23 +725,15 @@ blecent_should_connect(const struct ble_gap_disc_desc *disc)
         }
     }
 
-    /* The device has to advertise support for the Alert Notification
-     * service (0x1811).
-     */
-    for (i = 0; i < fields.num_uuids16; i++) {
-        if (ble_uuid_u16(&fields.uuids16[i].u) == BLECENT_SVC_ALERT_UUID) {
-            return 1;
-        }
-    }
-
-    return 0;
+    /* The device has to advertise the fan identity. */
+    return blecent_has_fan_ident(disc->data, disc->length_data);
 }
 #endif
 
 /**
  * Connects to the sender of the specified advertisement of it looks
  * interesting.  A device is "interesting" if it advertises connectability and
- * support for the Alert Notification service.
+ * the fan identity.
  */
 static void
 blecent_connect_if_interesting(void *disc)
@@ -673,6 +788,73 @@ blecent_connect_if_interesting(void *disc)
     }
 }
 
+#if NIMBLE_BLE_CONNECT
+/* PHY and LL data length agreed on each link */
+typedef struct {
+    bool     used;
+    uint16_t conn_handle;
+    uint8_t  tx_phy;            /* BLE_HCI_LE_PHY_* */
+    uint8_t  rx_phy;
+    uint16_t tx_octets;         /* largest LL payload in each direction */
+    uint16_t rx_octets;
+} blecent_link_t;
+
+static blecent_link_t blecent_links[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+
+static blecent_link_t *
+blecent_link_find(uint16_t conn_handle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+        if (blecent_links[i].used && blecent_links[i].conn_handle == conn_handle) {
+            return &blecent_links[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start a new link on 1M / 27 bytes and ask for the 2M PHY and the largest
+ * LL data length. Either request may be refused (a BLE 4.2 controller has
+ * no 2M PHY, an older fan may not support DLE); the link then keeps the
+ * defaults. The PHY and data length events record what was agreed.
+ */
+static void
+blecent_link_setup(uint16_t conn_handle)
+{
+    blecent_link_t *link = NULL;
+    int rc;
+
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS && link == NULL; i++) {
+        if (!blecent_links[i].used) {
+            link = &blecent_links[i];
+        }
+    }
+    if (link != NULL) {
+        link->used = true;
+        link->conn_handle = conn_handle;
+        link->tx_phy = BLE_HCI_LE_PHY_1M;
+        link->rx_phy = BLE_HCI_LE_PHY_1M;
+        link->tx_octets = BLECENT_LL_OCTETS_DFLT;
+        link->rx_octets = BLECENT_LL_OCTETS_DFLT;
+    }
+
+#if CONFIG_BT_NIMBLE_50_FEATURE_SUPPORT
+    rc = ble_gap_set_prefered_le_phy(conn_handle, BLE_GAP_LE_PHY_2M_MASK,
+                                     BLE_GAP_LE_PHY_2M_MASK,
+                                     BLE_GAP_LE_PHY_CODED_ANY);
+    if (rc != 0) {
+        MODLOG_DFLT(WARN, "2M PHY request failed; staying on 1M; rc=%d\n", rc);
+    }
+#endif
+
+    rc = ble_gap_set_data_len(conn_handle, BLECENT_LL_OCTETS_MAX,
+                              BLECENT_LL_TIME_MAX);
+    if (rc != 0) {
+        MODLOG_DFLT(WARN, "data length request failed; rc=%d\n", rc);
+    }
+}
+#endif
+
 #if MYNEWT_VAL(BLE_POWER_CONTROL)
 static void blecent_power_control(uint16_t conn_handle)
 {
@@ -692,6 +874,128 @@ static void blecent_power_control(uint16_t conn_handle)
 }
 #endif
 
+/**
+ * Decode a notification straight from its mbuf chain. A notification of the
+ * attached fan's aggregate status is logged field by field and fed to the
+ * control channel; anything else was already logged by length.
+ */
+static void
+blecent_on_notify(uint16_t conn_handle, uint16_t attr_handle,
+                  const struct os_mbuf *om)
+{
+    mbuf_cursor_t c;
+    uint8_t ver, flags, power, light;
+    uint32_t rpm, angle, seq, ack, clock;
+
+    if (conn_handle != blecent_stat_conn || attr_handle != blecent_stat_handle) {
+        return;
+    }
+    mbuf_cursor_init(&c, om);
+
+    if (mbuf_cursor_left(&c) >= BLECENT_FAN_STATUS_LEN &&
+        mbuf_cursor_u8(&c, &ver) == 0 && ver >= BLECENT_FAN_STATUS_VERSION) {
+        mbuf_cursor_u8(&c, &flags);
+        mbuf_cursor_u8(&c, &power);
+        mbuf_cursor_u8(&c, &light);
+        mbuf_cursor_le(&c, 4, &rpm);
+        mbuf_cursor_le(&c, 4, &angle);
+        mbuf_cursor_le(&c, 2, &seq);
+        mbuf_cursor_le(&c, 2, &ack);
+        mbuf_cursor_le(&c, 2, &clock);
+        /* newer record versions append fields; ignore the tail */
+        MODLOG_DFLT(INFO, "fan status: handle=%d power=%u light=%u rpm=%lu "
+                    "angle=%lu seq=%lu\n", attr_handle, power, light,
+                    (unsigned long)rpm, (unsigned long)angle, (unsigned long)seq);
+        fan_ctrl_on_status(conn_handle, (flags & BLECENT_FAN_STATUS_F_ACK) != 0,
+                           (uint16_t)ack, (uint16_t)clock);
+    }
+}
+
+#if CONFIG_EXAMPLE_EXTENDED_ADV && CONFIG_BT_NIMBLE_ENABLE_PERIODIC_SYNC
+static bool blecent_train_synced;       /* synced, or a sync is pending */
+
+/**
+ * Sync to a fan's periodic status train when its announcement is heard.
+ * One train at a time. A pending sync needs scanning, so it only completes
+ * while the remote is still looking for a fan to connect to.
+ */
+static void
+blecent_sync_if_fan_train(const struct ble_gap_ext_disc_desc *disc)
+{
+    struct ble_gap_periodic_sync_params params = {0};
+    uint32_t timeout;
+    int rc;
+
+    if (blecent_train_synced || disc->periodic_adv_itvl == 0 ||
+        disc->sid != BLECENT_FAN_TRAIN_SID) {
+        return;
+    }
+
+    /* lose sync after about six missed trains (1.25 ms -> 10 ms units) */
+    timeout = (uint32_t)disc->periodic_adv_itvl * 3 / 4;
+    params.skip = 0;
+    params.sync_timeout = timeout < 100 ? 100 : (timeout > 0x4000 ? 0x4000 : timeout);
+    rc = ble_gap_periodic_adv_sync_create(&disc->addr, disc->sid, &params,
+                                          blecent_gap_event, NULL);
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "periodic sync create failed; rc=%d\n", rc);
+        return;
+    }
+    blecent_train_synced = true;
+}
+
+/* Little-endian value of the `n` bytes at `p` */
+static uint32_t
+blecent_get_le(const uint8_t *p, int n)
+{
+    uint32_t v = 0;
+
+    while (n-- > 0) {
+        v = (v << 8) | p[n];
+    }
+    return v;
+}
+
+/**
+ * Decode a fan status beacon from advertising data. The train repeats
+ * the same record until the state changes, so only a new seq is logged.
+ */
+static void
+blecent_on_beacon(const uint8_t *data, uint8_t len)
+{
+    static bool have_seq;
+    static uint16_t last_seq;
+    uint8_t off = 0;
+
+    while (off + 1 < len) {
+        uint8_t ad_len = data[off];
+        const uint8_t *ad = &data[off + 1];
+
+        if (ad_len == 0 || off + 1 + ad_len > len) {
+            return;
+        }
+        if (ad[0] == BLE_HS_ADV_TYPE_MFG_DATA &&
+            ad_len >= 3 + BLECENT_FAN_BEACON_LEN &&
+            blecent_get_le(&ad[1], 2) == BLECENT_FAN_COMPANY_ID &&
+            ad[3] >= BLECENT_FAN_BEACON_VERSION) {
+            const uint8_t *b = &ad[3];
+            uint16_t seq = (uint16_t)blecent_get_le(&b[12], 2);
+
+            if (!have_seq || seq != last_seq) {
+                have_seq = true;
+                last_seq = seq;
+                MODLOG_DFLT(INFO, "fan beacon: power=%u light=%u wifi=%u rpm=%lu "
+                            "angle=%lu seq=%u\n", b[1], b[2], b[3],
+                            (unsigned long)blecent_get_le(&b[4], 4),
+                            (unsigned long)blecent_get_le(&b[8], 4), seq);
+            }
+            return;
+        }
+        off += 1 + ad_len;
+    }
+}
+#endif
+
 /**
  * The nimble host executes this callback when a GAP event occurs.  The
  * application associates a GAP event callback with each connection that is
@@ -746,6 +1050,7 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
             assert(rc == 0);
             print_conn_desc(&desc);
             MODLOG_DFLT(INFO, "\n");
+            blecent_fan_connected(&desc);
 
             /* Remember peer. */
             rc = peer_add(event->connect.conn_handle);
@@ -753,6 +1058,7 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
                 MODLOG_DFLT(ERROR, "Failed to add peer; rc=%d\n", rc);
                 return 0;
             }
+            blecent_link_setup(event->connect.conn_handle);
 
 #if MYNEWT_VAL(BLE_POWER_CONTROL)
             //ESP_LOGI(tag, "Setting up Power Control \n");
@@ -818,7 +1124,18 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
         MODLOG_DFLT(INFO, "\n");
 
         /* Forget about peer. */
+        blecent_fan_disconnected(&event->disconnect.conn);
         peer_delete(event->disconnect.conn.conn_handle);
+        fan_ctrl_detach(event->disconnect.conn.conn_handle);
+        if (blecent_stat_conn == event->disconnect.conn.conn_handle) {
+            blecent_stat_conn = BLE_HS_CONN_HANDLE_NONE;
+        }
+        {
+            blecent_link_t *link = blecent_link_find(event->disconnect.conn.conn_handle);
+            if (link != NULL) {
+                link->used = false;
+            }
+        }
 
 #if MYNEWT_VAL(BLE_EATT_CHAN_NUM) > 0
         /* Reset EATT config */
@@ -868,8 +1185,10 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
                     event->notify_rx.attr_handle,
                     OS_MBUF_PKTLEN(event->notify_rx.om));
 
-        /* Attribute data is contained in event->notify_rx.om. Use
-         * `os_mbuf_copydata` to copy the data received in notification mbuf */
+        /* Attribute data is contained in event->notify_rx.om; read it in
+         * place with a cursor instead of copying it out. */
+        blecent_on_notify(event->notify_rx.conn_handle,
+                          event->notify_rx.attr_handle, event->notify_rx.om);
         return 0;
 
     case BLE_GAP_EVENT_MTU:
@@ -879,6 +1198,35 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
                     event->mtu.value);
         return 0;
 
+    case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+        MODLOG_DFLT(INFO, "phy update; conn_handle=%d status=%d tx_phy=%d rx_phy=%d\n",
+                    event->phy_updated.conn_handle,
+                    event->phy_updated.status,
+                    event->phy_updated.tx_phy,
+                    event->phy_updated.rx_phy);
+        if (event->phy_updated.status == 0) {
+            blecent_link_t *link = blecent_link_find(event->phy_updated.conn_handle);
+            if (link != NULL) {
+                link->tx_phy = event->phy_updated.tx_phy;
+                link->rx_phy = event->phy_updated.rx_phy;
+            }
+        }
+        return 0;
+
+    case BLE_GAP_EVENT_DATA_LEN_CHG:
+        MODLOG_DFLT(INFO, "data length; conn_handle=%d max_tx=%d max_rx=%d\n",
+                    event->data_len_chg.conn_handle,
+                    event->data_len_chg.max_tx_octets,
+                    event->data_len_chg.max_rx_octets);
+        {
+            blecent_link_t *link = blecent_link_find(event->data_len_chg.conn_handle);
+            if (link != NULL) {
+                link->tx_octets = event->data_len_chg.max_tx_octets;
+                link->rx_octets = event->data_len_chg.max_rx_octets;
+            }
+        }
+        return 0;
+
     case BLE_GAP_EVENT_REPEAT_PAIRING:
         /* We already have a bond with the peer, but it is attempting to
          * establish a new secure link.  This app sacrifices security for
@@ -900,8 +1248,37 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
         /* An advertisement report was received during GAP discovery. */
         ext_print_adv_report(&event->ext_disc);
 
+#if CONFIG_BT_NIMBLE_ENABLE_PERIODIC_SYNC
+        blecent_sync_if_fan_train(&event->ext_disc);
+#endif
         blecent_connect_if_interesting(&event->ext_disc);
         return 0;
+
+#if CONFIG_BT_NIMBLE_ENABLE_PERIODIC_SYNC
+    case BLE_GAP_EVENT_PERIODIC_SYNC:
+        if (event->periodic_sync.status != 0) {
+            MODLOG_DFLT(ERROR, "periodic sync failed; status=%d\n",
+                        event->periodic_sync.status);
+            blecent_train_synced = false;
+            return 0;
+        }
+        MODLOG_DFLT(INFO, "synced to fan status train; sync_handle=%d addr=%s\n",
+                    event->periodic_sync.sync_handle,
+                    addr_str(event->periodic_sync.adv_addr.val));
+        return 0;
+
+    case BLE_GAP_EVENT_PERIODIC_REPORT:
+        blecent_on_beacon(event->periodic_report.data,
+                          event->periodic_report.data_length);
+        return 0;
+
+    case BLE_GAP_EVENT_PERIODIC_SYNC_LOST:
+        MODLOG_DFLT(INFO, "fan status train lost; sync_handle=%d reason=%d\n",
+                    event->periodic_sync_lost.sync_handle,
+                    event->periodic_sync_lost.reason);
+        blecent_train_synced = false;
+        return 0;
+#endif
 #endif
 
 #if MYNEWT_VAL(BLE_POWER_CONTROL)
@@ -1090,6 +1467,12 @@ app_main(void)
     /* XXX Need to have template for store */
     ble_store_config_init();
 
+    if (fan_ctrl_init() != 0) {
+        ESP_LOGE(tag, "Failed to init the fan control channel");
+    } else if (fan_cli_init() != 0) {
+        ESP_LOGE(tag, "Failed to start the fan console");
+    }
+
     nimble_port_freertos_init(blecent_host_task);
 
 #if CONFIG_EXAMPLE_INIT_DEINIT_LOOP